@@ -1,4 +1,4 @@
 #!/bin/sh
 
 mkdir -p build
-clang++ -std=c++20 -mavx2 -O3 -g -fsanitize=address matmul.cpp -o build/main
+clang++ -std=c++20 -O3 -g -fsanitize=address -pthread matmul.cpp -o build/main
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+#include "matrix.hpp"
+#include "thread_pool.hpp"
+#include "simd_vectors.hpp"
+
+// Picking the kernels for the cpu we run on.
+// Every kernel of simd_kernels.hpp exists once per ISA level (scalar, SSE4.1, AVX2, AVX-512).
+// At startup the best level the cpu supports is picked (cpuid, through __builtin_cpu_supports, which also checks
+// that the OS saves the wider registers), and the kernels below call that level's copy through a table of pointers.
+// MATMUL_ISA=scalar|sse4.1|avx2|avx512 in the environment (or force_isa()) picks a lower level instead,
+// e.g. to test the SSE kernels on an AVX-512 machine.
+
+namespace scalar {
+#define KERNEL_TARGET
+#include "simd_kernels.hpp"
+#undef KERNEL_TARGET
+}
+
+namespace sse41 {
+#define KERNEL_TARGET TARGET_SSE41
+#include "simd_kernels.hpp"
+#undef KERNEL_TARGET
+}
+
+namespace avx2 {
+#define KERNEL_TARGET TARGET_AVX2
+#include "simd_kernels.hpp"
+#undef KERNEL_TARGET
+}
+
+namespace avx512 {
+#define KERNEL_TARGET TARGET_AVX512
+#include "simd_kernels.hpp"
+#undef KERNEL_TARGET
+}
+
+
+namespace dispatch {
+
+// from the oldest to the newest
+enum class Isa {
+  scalar,
+  sse41,
+  avx2,
+  avx512
+};
+
+const vector<Isa> ALL_ISAS = {Isa::scalar, Isa::sse41, Isa::avx2, Isa::avx512};
+
+string isa_name(Isa isa) {
+  switch (isa) {
+    case Isa::scalar: return "scalar";
+    case Isa::sse41: return "sse4.1";
+    case Isa::avx2: return "avx2";
+    case Isa::avx512: return "avx512";
+  }
+  return "?";
+}
+
+bool is_supported(Isa isa) {
+  __builtin_cpu_init();
+  switch (isa) {
+    case Isa::scalar: return true;
+    case Isa::sse41: return __builtin_cpu_supports("sse4.1");
+    case Isa::avx2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case Isa::avx512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")
+                             && __builtin_cpu_supports("fma");
+  }
+  return false;
+}
+
+Isa best_supported_isa() {
+  Isa best = Isa::scalar;
+  for (Isa isa: ALL_ISAS) {
+    if (is_supported(isa)) {
+      best = isa;
+    }
+  }
+  return best;
+}
+
+// the best one, or the one MATMUL_ISA asks for if the cpu has it
+Isa startup_isa() {
+  const Isa best = best_supported_isa();
+  const char* forced = getenv("MATMUL_ISA");
+  if (forced == nullptr) {
+    return best;
+  }
+  for (Isa isa: ALL_ISAS) {
+    if (isa_name(isa) == forced) {
+      if (is_supported(isa)) {
+        return isa;
+      }
+      cerr << "MATMUL_ISA=" << forced << " is not supported by this cpu, using " << isa_name(best) << endl;
+      return best;
+    }
+  }
+  cerr << "Unknown MATMUL_ISA=" << forced << ", using " << isa_name(best) << endl;
+  return best;
+}
+
+Isa& active_isa() {
+  static Isa isa = startup_isa();
+  return isa;
+}
+
+// Switches all the kernels to the level, returns false (and switches nothing) if the cpu doesn't support it.
+// Not thread safe, meant for tests and benchmarks between products.
+bool force_isa(Isa isa) {
+  if (!is_supported(isa)) {
+    return false;
+  }
+  active_isa() = isa;
+  return true;
+}
+
+template<typename T>
+struct Kernels {
+  Matrix<T> (*simd_matmul)(const Matrix<T>&, const Matrix<T>&);
+  Matrix<T> (*simd_matmul2)(const Matrix<T>&, const Matrix<T>&);
+  Matrix<T> (*blocked_matmul)(const Matrix<T>&, const Matrix<T>&);
+  Matrix<T> (*parallel_matmul)(ThreadPool&, const Matrix<T>&, const Matrix<T>&);
+  void (*blocked_multiply_add)(int, int, int, const T*, int, const T*, int, T*, int, vector<T>&, vector<T>&);
+};
+
+template<typename T>
+Kernels<T> kernels_for(Isa isa) {
+  switch (isa) {
+    case Isa::sse41:
+      return {sse41::simd_matmul<T>, sse41::simd_matmul2<T>, sse41::blocked_matmul<T>, sse41::parallel_matmul<T>,
+              sse41::blocked_multiply_add<T>};
+    case Isa::avx2:
+      return {avx2::simd_matmul<T>, avx2::simd_matmul2<T>, avx2::blocked_matmul<T>, avx2::parallel_matmul<T>,
+              avx2::blocked_multiply_add<T>};
+    case Isa::avx512:
+      return {avx512::simd_matmul<T>, avx512::simd_matmul2<T>, avx512::blocked_matmul<T>, avx512::parallel_matmul<T>,
+              avx512::blocked_multiply_add<T>};
+    default:
+      return {scalar::simd_matmul<T>, scalar::simd_matmul2<T>, scalar::blocked_matmul<T>, scalar::parallel_matmul<T>,
+              scalar::blocked_multiply_add<T>};
+  }
+}
+
+template<typename T>
+Kernels<T> active_kernels() {
+  return kernels_for<T>(active_isa());
+}
+
+}
+
+
+// The kernels of the active level
+
+// the dot product of a row and a column gathered from all over b
+template<typename T>
+Matrix<T> simd_matmul(const Matrix<T>& a, const Matrix<T>& b) {
+  return dispatch::active_kernels<T>().simd_matmul(a, b);
+}
+
+// the dot product of a row and a row of b transposed
+template<typename T>
+Matrix<T> simd_matmul2(const Matrix<T>& a, const Matrix<T>& b) {
+  return dispatch::active_kernels<T>().simd_matmul2(a, b);
+}
+
+// packed, cache blocked with a register tiled micro-kernel
+template<typename T>
+Matrix<T> blocked_matmul(const Matrix<T>& a, const Matrix<T>& b) {
+  return dispatch::active_kernels<T>().blocked_matmul(a, b);
+}
+
+// c += a * b with blocked_matmul()'s kernel on row major blocks (rows lda, ldb and ldc numbers apart)
+// of bigger matrices, with the caller's packing buffers
+template<typename T>
+void blocked_multiply_add(int m, int k, int n, const T* a, int lda, const T* b, int ldb, T* c, int ldc,
+                          vector<T>& packed_a, vector<T>& packed_b) {
+  dispatch::active_kernels<T>().blocked_multiply_add(m, k, n, a, lda, b, ldb, c, ldc, packed_a, packed_b);
+}
+
+// blocked_matmul() on all the threads of the pool
+template<typename T>
+Matrix<T> parallel_matmul(ThreadPool& pool, const Matrix<T>& a, const Matrix<T>& b) {
+  return dispatch::active_kernels<T>().parallel_matmul(pool, a, b);
+}
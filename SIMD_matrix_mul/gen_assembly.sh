@@ -1,3 +1,3 @@
 #!/bin/bash
 
-clang++ -std=c++20 -O3 -mavx2 -S -fverbose-asm -S matmul.cpp
+clang++ -std=c++20 -O3 -S -fverbose-asm -S matmul.cpp
@@ -6,26 +6,38 @@
 #include <functional>
 #include <iomanip>
 #include <sstream>
-#include <immintrin.h>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <array>
+#include "matrix.hpp"
+#include "thread_pool.hpp"
+#include "dispatch.hpp"
+#include "strassen.hpp"
 
 using namespace std;
 
 
-struct Matrix {
-  int rows; 
-  int cols;
-  vector<int> data;
-};
-
-
 class RandomGen {
 public:
   RandomGen(): rand_eng(random_device{}()), uniform_distrib(1,1000) {
   }
-  vector<int> gen_vector(int n) {
-    vector<int> ret(n);
-    for (int i=0; i<n; i++) {
-      ret[i] = uniform_distrib(rand_eng);
+  // ints from 1 to 1000, floats and doubles from -1 to 1
+  template<typename T>
+  vector<T> gen_vector(int n) {
+    vector<T> ret(n);
+    if constexpr (is_integral_v<T>) {
+      for (int i=0; i<n; i++) {
+        ret[i] = uniform_distrib(rand_eng);
+      }
+    } else {
+      uniform_real_distribution<T> real_distrib(-1, 1);
+      for (int i=0; i<n; i++) {
+        ret[i] = real_distrib(rand_eng);
+      }
     }
     return ret;
   }
@@ -38,18 +50,18 @@ private:
 };
 
 
-
-Matrix matmul(const Matrix& a, const Matrix& b) {
+template<typename T>
+Matrix<T> matmul(const Matrix<T>& a, const Matrix<T>& b) {
   assert(a.cols == b.rows);
-  Matrix ans = {
+  Matrix<T> ans = {
     .rows = a.rows,
     .cols = b.cols,
-    .data = vector<int>(a.rows * b.cols),
+    .data = vector<T>(a.rows * b.cols),
   };
   for (int r=0; r<a.rows; r++) {
     for (int c=0; c<b.cols; c++) {
-      int s = 0;
-      for (int i=0; i<a.cols; i++) {  
+      T s = 0;
+      for (int i=0; i<a.cols; i++) {
         s += a.data[r * a.cols + i] * b.data[i * b.cols + c];
       }
       ans.data[r * ans.cols + c] = s;
@@ -59,106 +71,54 @@ Matrix matmul(const Matrix& a, const Matrix& b) {
 }
 
 
-Matrix avx2_matmul(const Matrix& a, const Matrix& b) {
-  // assuming AVX2 vectorization in intel CPUs
-  // availabe AVX2 intrinsics:
-  // https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#avxnewtechs=AVX2
-  assert(a.cols == b.rows);
-  Matrix ans = {
-    .rows = a.rows,
-    .cols = b.cols,
-    .data = vector<int>(a.rows * b.cols)
-  };
-  for (int r=0; r<a.rows; r++) {
-    for (int c=0; c<b.cols; c++) {
-      int s = 0;
-      int i = 0;
-      while (i + 8 <= a.cols) {
-        // for row: loading 8 contiguous int bytes from memory to 256 bit register in cpu
-        __m256i rownums = _mm256_loadu_si256((__m256i *) &a.data[r * a.cols + i]);
-        // for column: setting indices to gather the data from memory to the 256 bit register in cpu
-        __m256i indices = _mm256_setr_epi32(0, b.cols, b.cols * 2, b.cols * 3, b.cols * 4, b.cols * 5, b.cols * 6, b.cols * 7);
-        // gathering 8 ints from column in memory to the cpu register. Scaling by 4 as Ints take 4 bytes
-        __m256i colnums = _mm256_i32gather_epi32((int*)&b.data[i * b.cols + c], indices, 4);
-        // multiplying 8 ints at once. ignore overflow.
-        __m256i mults = _mm256_mullo_epi32(rownums, colnums);
-
-        // Pull the multipled result from CPU into memory
-        // alignment ensures all the bits of the data will fit in a CPU cache, avoiding multiple pulls when the data crosses cache boundary
-        alignas(32) int temp[8];
-        _mm256_storeu_si256((__m256i *)temp, mults);
-
-        // usually modern compilers can vectorize simple additions like this
-        // so not manually calling the intrinsics
-        s += temp[0] + temp[1] + temp[2] + temp[3] + temp[4] + temp[5] + temp[6] + temp[7];
-        i += 8;
-      }
-      while (i < a.cols) {
-        s += a.data[r * a.cols + i] * b.data[i * b.cols + c];
-        i++;
-      }
-      ans.data[r * ans.cols + c] = s;
-    }
-  }
-  return ans;
+template<typename T>
+pair<long long, Matrix<T>> multiply(const Matrix<T>& a, const Matrix<T>& b,
+                                    function<Matrix<T>(const Matrix<T>&, const Matrix<T>&)> mult_func) {
+  auto start = chrono::high_resolution_clock::now();
+  Matrix<T> result = mult_func(a, b);
+  auto end = chrono::high_resolution_clock::now();
+  return {chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), result};
 }
 
 
-Matrix avx2_matmul2(const Matrix& a, const Matrix& b) {
-  assert(a.cols == b.rows);
-  // Main improvement: Transpose Matrix B
-  // such that the column data would be contiguous
-  // With it the column data better fits in the same cache line
-  // Also we would be able to quickly pick the data into 256 bit register in CPU instead of having to gather from all over the memory
-  Matrix bt = {
-    .rows = b.cols,
-    .cols = b.rows,
-    .data = vector<int>(b.rows * b.cols)
-  };
-  for (int i=0; i<b.rows; i++) {
-    for (int j=0; j<b.cols; j++) {
-      bt.data[j * bt.cols + i] = b.data[i * b.cols + j];
-    }
+// Whether result is a * b, expected being another kernel's (e.g. matmul's) answer.
+// ints have to match exactly. Floating point kernels add the products up in different orders
+// (and FMA rounds once where mul + add rounds twice) so they differ in the last bits.
+// Adding up k products is off by about sqrt(k) * epsilon * (|a_r1 * b_1c| + ... + |a_rk * b_kc|) for random data
+// and that sum is at most |row r of a| * |column c of b| (Cauchy-Schwarz), allowing 4x of that for both results.
+// slack allows that many times more, for results that add up more than the plain sums (strassen_matmul()).
+template<typename T>
+bool close_enough(const Matrix<T>& a, const Matrix<T>& b, const Matrix<T>& expected, const Matrix<T>& result,
+                  double slack = 1) {
+  if (expected.rows != result.rows || expected.cols != result.cols) {
+    return false;
   }
-  Matrix ans = {
-    .rows = a.rows,
-    .cols = b.cols,
-    .data = vector<int>(a.rows * b.cols)
-  };
-  for (int r=0; r<a.rows; r++) {
-    for (int c=0; c<b.cols; c++) {
-      int s = 0;
-      int i = 0;
-      while (i + 8 <= a.cols) {
-        __m256i rownums = _mm256_loadu_si256((__m256i *) &a.data[r * a.cols + i]);
-        __m256i colnums = _mm256_loadu_si256((__m256i *) &bt.data[c * bt.cols + i]);
-        __m256i mults = _mm256_mullo_epi32(rownums, colnums);
-
-        // Pull the multipled result from CPU into memory
-        // alignment ensures all the bits of the data will fit in a CPU cache, avoiding multiple pulls when the data crosses cache boundary
-        alignas(32) int temp[8];
-        _mm256_storeu_si256((__m256i *)temp, mults);
-
-        // usually modern compilers can vectorize simple additions like this
-        // so not manually calling the intrinsics
-        s += temp[0] + temp[1] + temp[2] + temp[3] + temp[4] + temp[5] + temp[6] + temp[7];
-        i += 8;
+  if constexpr (is_integral_v<T>) {
+    return expected.data == result.data;
+  } else {
+    vector<double> row_norms(a.rows);
+    vector<double> col_norms(b.cols);
+    for (int r=0; r<a.rows; r++) {
+      for (int i=0; i<a.cols; i++) {
+        row_norms[r] += (double)a.data[r * a.cols + i] * a.data[r * a.cols + i];
       }
-      while (i < a.cols) {
-        s += a.data[r * a.cols + i] * bt.data[c * bt.cols + i];
-        i++;
+    }
+    for (int i=0; i<b.rows; i++) {
+      for (int c=0; c<b.cols; c++) {
+        col_norms[c] += (double)b.data[i * b.cols + c] * b.data[i * b.cols + c];
       }
-      ans.data[r * ans.cols + c] = s;
     }
+    const double tolerance = slack * 4 * sqrt((double)a.cols) * numeric_limits<T>::epsilon();
+    for (int r=0; r<result.rows; r++) {
+      for (int c=0; c<result.cols; c++) {
+        const double error = abs((double)expected.data[r * result.cols + c] - result.data[r * result.cols + c]);
+        if (error > tolerance * sqrt(row_norms[r] * col_norms[c])) {
+          return false;
+        }
+      }
+    }
+    return true;
   }
-  return ans;
-}
-
-pair<long long, Matrix> multiply(const Matrix& a, const Matrix& b, function<Matrix(const Matrix&, const Matrix&)> mult_func) {
-  auto start = chrono::high_resolution_clock::now();
-  Matrix result = mult_func(a, b);
-  auto end = chrono::high_resolution_clock::now();
-  return {chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), result};
 }
 
 
@@ -170,61 +130,236 @@ string format_duration(long long ns) {
 }
 
 
-int main() {
-  cout << "Testing & benchmarking!!" << endl;
-  RandomGen rand_gen;
+// all the kernels on 20 random shapes up to [1000, 1000] X [1000, 1000]
+template<typename T>
+void benchmark(const string& type_name, RandomGen& rand_gen, ThreadPool& all_cores) {
+  std::cout << type_name << std::endl;
   long long total_dur1 = 0;
   long long total_dur2 = 0;
   long long total_dur3 = 0;
+  long long total_dur4 = 0;
+  long long total_dur5 = 0;
   for (int i=0; i<20; i++) {
     int p = rand_gen.gen_int();
     int q = rand_gen.gen_int();
     int r = rand_gen.gen_int();
-    Matrix ma = {
+    Matrix<T> ma = {
       .rows = p,
       .cols = q,
-      .data = rand_gen.gen_vector(p * q),
+      .data = rand_gen.gen_vector<T>(p * q),
     };
-    Matrix mb = {
+    Matrix<T> mb = {
       .rows = q,
       .cols = r,
-      .data = rand_gen.gen_vector(q * r),
+      .data = rand_gen.gen_vector<T>(q * r),
     };
-    auto [dur1, res1] = multiply(ma, mb, matmul);
-    auto [dur2, res2] = multiply(ma, mb, avx2_matmul);
-    auto [dur3, res3] = multiply(ma, mb, avx2_matmul2);
+    auto [dur1, res1] = multiply<T>(ma, mb, matmul<T>);
+    auto [dur2, res2] = multiply<T>(ma, mb, simd_matmul<T>);
+    auto [dur3, res3] = multiply<T>(ma, mb, simd_matmul2<T>);
+    auto [dur4, res4] = multiply<T>(ma, mb, blocked_matmul<T>);
+    auto [dur5, res5] = multiply<T>(ma, mb, [&](const Matrix<T>& a, const Matrix<T>& b) {
+      return parallel_matmul(all_cores, a, b);
+    });
 
-    for (int i=0; i<res1.data.size(); i++) {
-      assert(res1.data[i] == res2.data[i] && res2.data[i] == res3.data[i]);
-    }
+    assert(close_enough(ma, mb, res1, res2) && close_enough(ma, mb, res1, res3) && close_enough(ma, mb, res1, res4)
+           && close_enough(ma, mb, res1, res5));
 
     total_dur1 += dur1;
     total_dur2 += dur2;
     total_dur3 += dur3;
+    total_dur4 += dur4;
+    total_dur5 += dur5;
 
     std::cout << std::fixed << std::setprecision(2);
-    std::cout 
+    std::cout
         << "[" << std::setw(4) << ma.rows << ", " << std::setw(4) << ma.cols << "] X "
         << "[" << std::setw(4) << mb.rows << ", " << std::setw(4) << mb.cols << "] "
         << std::setw(14) << std::right << "Normal: " << std::setw(4) << format_duration(dur1)
         << std::setw(20) << "SIMD (gather): " << std::setw(4) << format_duration(dur2)
         << std::setw(3) <<  "(" << (double)dur1/dur2 << "x speedup)  "
         << std::setw(28) << "SIMD (with transpose): " << std::setw(4) << format_duration(dur3)
-        << std::setw(3) << "(" << (double)dur1/dur3 << "x speedup)"
+        << std::setw(3) << "(" << (double)dur1/dur3 << "x speedup)  "
+        << std::setw(26) << "SIMD (packed, blocked): " << std::setw(4) << format_duration(dur4)
+        << std::setw(3) << "(" << (double)dur1/dur4 << "x speedup)  "
+        << std::setw(22) << "Parallel (" << all_cores.size() << " threads): " << std::setw(4) << format_duration(dur5)
+        << std::setw(3) << "(" << (double)dur1/dur5 << "x speedup)"
         << std::endl;
   };
   long long avg1 = total_dur1 / 20;
   long long avg2 = total_dur2 / 20;
   long long avg3 = total_dur3 / 20;
+  long long avg4 = total_dur4 / 20;
+  long long avg5 = total_dur5 / 20;
   std::cout << std::endl;
   std::cout << "Average" << std::endl;
-  std::cout 
+  std::cout
         << "Normal: " << std::setw(4) << format_duration(avg1)
         << std::setw(20) << "SIMD (gather): " << std::setw(4) << format_duration(avg2)
         << std::setw(3) <<  "(" << (double)avg1/avg2 << "x speedup)  "
         << std::setw(28) << "SIMD (with transpose): " << std::setw(4) << format_duration(avg3)
-        << std::setw(3) << "(" << (double)avg1/avg3 << "x speedup)"
+        << std::setw(3) << "(" << (double)avg1/avg3 << "x speedup)  "
+        << std::setw(26) << "SIMD (packed, blocked): " << std::setw(4) << format_duration(avg4)
+        << std::setw(3) << "(" << (double)avg1/avg4 << "x speedup)  "
+        << std::setw(22) << "Parallel (" << all_cores.size() << " threads): " << std::setw(4) << format_duration(avg5)
+        << std::setw(3) << "(" << (double)avg1/avg5 << "x speedup)"
         << std::endl;
+  std::cout << std::endl;
+}
+
+
+// strassen_matmul() against blocked_matmul() on 5 random shapes from [2049, 3048] in every dimension,
+// big enough for at least one split at STRASSEN_CUTOFF (the shapes of benchmark() never split)
+template<typename T>
+void benchmark_strassen(const string& type_name, RandomGen& rand_gen) {
+  std::cout << "Strassen " << type_name << std::endl;
+  long long total_blocked_dur = 0;
+  long long total_strassen_dur = 0;
+  for (int i=0; i<5; i++) {
+    int p = 2048 + rand_gen.gen_int();
+    int q = 2048 + rand_gen.gen_int();
+    int r = 2048 + rand_gen.gen_int();
+    Matrix<T> ma = { .rows = p, .cols = q, .data = rand_gen.gen_vector<T>(p * q) };
+    Matrix<T> mb = { .rows = q, .cols = r, .data = rand_gen.gen_vector<T>(q * r) };
+    auto [blocked_dur, blocked_res] = multiply<T>(ma, mb, blocked_matmul<T>);
+    auto [strassen_dur, strassen_res] = multiply<T>(ma, mb, [](const Matrix<T>& a, const Matrix<T>& b) {
+      return strassen_matmul(a, b);
+    });
+    assert(close_enough(ma, mb, blocked_res, strassen_res));
+    total_blocked_dur += blocked_dur;
+    total_strassen_dur += strassen_dur;
+    std::cout
+        << "[" << std::setw(4) << ma.rows << ", " << std::setw(4) << ma.cols << "] X "
+        << "[" << std::setw(4) << mb.rows << ", " << std::setw(4) << mb.cols << "] "
+        << std::setw(26) << "SIMD (packed, blocked): " << std::setw(4) << format_duration(blocked_dur)
+        << std::setw(14) << "Strassen: " << std::setw(4) << format_duration(strassen_dur)
+        << std::setw(3) << "(" << (double)blocked_dur/strassen_dur << "x speedup)" << std::endl;
+  }
+  std::cout << "Average"
+      << std::setw(26) << "SIMD (packed, blocked): " << std::setw(4) << format_duration(total_blocked_dur / 5)
+      << std::setw(14) << "Strassen: " << std::setw(4) << format_duration(total_strassen_dur / 5)
+      << std::setw(3) << "(" << (double)total_blocked_dur/total_strassen_dur << "x speedup)" << std::endl;
+  std::cout << std::endl;
+}
+
+
+// the kernels of every level the cpu has against matmul()
+template<typename T>
+void check_isas(RandomGen& rand_gen, ThreadPool& pool) {
+  const int p = 123;
+  const int q = 457;
+  const int r = 301;
+  Matrix<T> ma = { .rows = p, .cols = q, .data = rand_gen.gen_vector<T>(p * q) };
+  Matrix<T> mb = { .rows = q, .cols = r, .data = rand_gen.gen_vector<T>(q * r) };
+  Matrix<T> expected = matmul(ma, mb);
+  for (dispatch::Isa isa: dispatch::ALL_ISAS) {
+    if (!dispatch::is_supported(isa)) {
+      continue;
+    }
+    auto kernels = dispatch::kernels_for<T>(isa);
+    assert(close_enough(ma, mb, expected, kernels.simd_matmul(ma, mb))
+           && close_enough(ma, mb, expected, kernels.simd_matmul2(ma, mb))
+           && close_enough(ma, mb, expected, kernels.blocked_matmul(ma, mb))
+           && close_enough(ma, mb, expected, kernels.parallel_matmul(pool, ma, mb)));
+  }
+}
+
+// strassen_matmul() with small cutoffs against matmul(), so odd and rectangular shapes get padded and split
+// 1, 2 and 3 levels deep, on every level the cpu has (the leaves are blocked_matmul() of the active level).
+// The additions of every split about double the floating point error, so 2^levels of slack.
+template<typename T>
+void check_strassen(RandomGen& rand_gen) {
+  const dispatch::Isa active = dispatch::active_isa();
+  for (auto [p, q, r]: {array{7, 13, 5}, array{97, 513, 33}, array{40, 24, 56}, array{123, 457, 301}}) {
+    Matrix<T> ma = { .rows = p, .cols = q, .data = rand_gen.gen_vector<T>(p * q) };
+    Matrix<T> mb = { .rows = q, .cols = r, .data = rand_gen.gen_vector<T>(q * r) };
+    Matrix<T> expected = matmul(ma, mb);
+    for (dispatch::Isa isa: dispatch::ALL_ISAS) {
+      if (!dispatch::is_supported(isa)) {
+        continue;
+      }
+      dispatch::force_isa(isa);
+      for (int levels=1; levels<=3; levels++) {
+        // splits exactly levels times
+        const int cutoff = min({p, q, r}) >> levels;
+        if (cutoff > 0) {
+          assert(close_enough(ma, mb, expected, strassen_matmul(ma, mb, cutoff), 1 << levels));
+        }
+      }
+    }
+  }
+  dispatch::force_isa(active);
+}
+
+
+int main() {
+  cout << "Testing & benchmarking!!" << endl;
+  cout << "Kernels: " << dispatch::isa_name(dispatch::active_isa())
+       << " (best supported: " << dispatch::isa_name(dispatch::best_supported_isa()) << ", override with MATMUL_ISA)" << endl;
+  RandomGen rand_gen;
+  // started once up front and used for everything but the scaling
+  const int max_threads = max(1u, thread::hardware_concurrency());
+  ThreadPool all_cores(max_threads);
+
+  check_isas<int>(rand_gen, all_cores);
+  check_isas<float>(rand_gen, all_cores);
+  check_isas<double>(rand_gen, all_cores);
+  check_strassen<int>(rand_gen);
+  check_strassen<float>(rand_gen);
+  check_strassen<double>(rand_gen);
+  cout << "All the supported ISA levels agree" << endl << endl;
+
+  benchmark<int>("int32 (wrapping around on overflow)", rand_gen, all_cores);
+  benchmark<float>("float32", rand_gen, all_cores);
+  benchmark<double>("float64", rand_gen, all_cores);
+  benchmark_strassen<int>("int32 (wrapping around on overflow)", rand_gen);
+  benchmark_strassen<float>("float32", rand_gen);
+  benchmark_strassen<double>("float64", rand_gen);
+
+  // how parallel_matmul() scales with the number of threads on one big float product
+  const int n = 1500;
+  Matrix<float> ma = { .rows = n, .cols = n, .data = rand_gen.gen_vector<float>(n * n) };
+  Matrix<float> mb = { .rows = n, .cols = n, .data = rand_gen.gen_vector<float>(n * n) };
+  std::cout << "Scaling of parallel_matmul float32 [" << n << ", " << n << "] X [" << n << ", " << n << "]" << std::endl;
+  auto [single_dur, single_res] = multiply<float>(ma, mb, blocked_matmul<float>);
+  std::cout << std::setw(12) << "blocked: " << format_duration(single_dur) << std::endl;
+  for (int t=1; t<=max_threads; t++) {
+    // a pool of its own for every step, only for as long as the step takes, all the cores reuse all_cores
+    unique_ptr<ThreadPool> step_pool = t < max_threads ? make_unique<ThreadPool>(t) : nullptr;
+    ThreadPool& pool = t < max_threads ? *step_pool : all_cores;
+    auto [dur, res] = multiply<float>(ma, mb, [&](const Matrix<float>& a, const Matrix<float>& b) {
+      return parallel_matmul(pool, a, b);
+    });
+    // every thread computes its tiles the same way blocked_matmul() does
+    assert(res.data == single_res.data);
+    std::cout << std::setw(3) << pool.size() << " threads: " << format_duration(dur)
+        << std::setw(3) << "(" << (double)single_dur/dur << "x speedup, "
+        << (double)single_dur/dur/pool.size() * 100 << "% efficiency)" << std::endl;
+  }
+  std::cout << std::endl;
+
+  // where strassen_matmul() starts to pay off over blocked_matmul(), to pick STRASSEN_CUTOFF.
+  // The best of 5 runs each, single runs of these differ by 10% and more.
+  const int big = 2048;
+  Matrix<float> big_a = { .rows = big, .cols = big, .data = rand_gen.gen_vector<float>(big * big) };
+  Matrix<float> big_b = { .rows = big, .cols = big, .data = rand_gen.gen_vector<float>(big * big) };
+  std::cout << "Strassen cutoffs float32 [" << big << ", " << big << "] X [" << big << ", " << big << "]" << std::endl;
+  auto best_of_5 = [&](function<Matrix<float>(const Matrix<float>&, const Matrix<float>&)> mult_func) {
+    auto [best_dur, res] = multiply<float>(big_a, big_b, mult_func);
+    for (int run=1; run<5; run++) {
+      best_dur = min(best_dur, multiply<float>(big_a, big_b, mult_func).first);
+    }
+    return pair{best_dur, res};
+  };
+  auto [blocked_dur, blocked_res] = best_of_5(blocked_matmul<float>);
+  std::cout << std::setw(16) << "blocked: " << format_duration(blocked_dur) << std::endl;
+  for (int cutoff: {128, 256, 512, 1024}) {
+    auto [dur, res] = best_of_5([&](const Matrix<float>& a, const Matrix<float>& b) {
+      return strassen_matmul(a, b, cutoff);
+    });
+    assert(close_enough(big_a, big_b, blocked_res, res));
+    std::cout << std::setw(6) << "cutoff " << std::setw(4) << cutoff << ": " << format_duration(dur)
+        << std::setw(3) << "(" << (double)blocked_dur/dur << "x speedup)" << std::endl;
+  }
 
   return 0;
 }
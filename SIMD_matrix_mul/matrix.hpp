@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+
+using namespace std;
+
+
+template<typename T>
+struct Matrix {
+  int rows;
+  int cols;
+  vector<T> data;
+};
@@ -0,0 +1,331 @@
+// The SIMD kernels, written once against Simd<T> (see simd_vectors.hpp).
+// No include guard on purpose: dispatch.hpp includes this once per ISA level, inside the level's namespace
+// and with KERNEL_TARGET set to the level's target attribute, which makes a copy of every kernel per level.
+// The headers it needs are included by dispatch.hpp up front, outside of the namespaces.
+
+template<typename T>
+KERNEL_TARGET Matrix<T> simd_matmul(const Matrix<T>& a, const Matrix<T>& b) {
+  using V = Simd<T>;
+  constexpr int L = V::LANES;
+  assert(a.cols == b.rows);
+  Matrix<T> ans = {
+    .rows = a.rows,
+    .cols = b.cols,
+    .data = vector<T>(a.rows * b.cols)
+  };
+  for (int r=0; r<a.rows; r++) {
+    for (int c=0; c<b.cols; c++) {
+      T s = 0;
+      int i = 0;
+      while (i + L <= a.cols) {
+        // for row: loading L contiguous numbers from memory to a vector register in cpu
+        auto rownums = V::load(&a.data[r * a.cols + i]);
+        // for column: gathering L numbers, b.cols apart, from all over the memory to the cpu register
+        auto colnums = V::gather(&b.data[i * b.cols + c], b.cols);
+        // multiplying L numbers at once
+        auto mults = V::mul(rownums, colnums);
+
+        // Pull the multipled result from CPU into memory
+        // alignment ensures all the bits of the data will fit in a CPU cache, avoiding multiple pulls when the data crosses cache boundary
+        alignas(64) T temp[L];
+        V::store(temp, mults);
+
+        // usually modern compilers can vectorize simple additions like this
+        // so not manually calling the intrinsics
+        for (int t=0; t<L; t++) {
+          s += temp[t];
+        }
+        i += L;
+      }
+      while (i < a.cols) {
+        s += a.data[r * a.cols + i] * b.data[i * b.cols + c];
+        i++;
+      }
+      ans.data[r * ans.cols + c] = s;
+    }
+  }
+  return ans;
+}
+
+
+template<typename T>
+KERNEL_TARGET Matrix<T> simd_matmul2(const Matrix<T>& a, const Matrix<T>& b) {
+  using V = Simd<T>;
+  constexpr int L = V::LANES;
+  assert(a.cols == b.rows);
+  // Main improvement: Transpose Matrix B
+  // such that the column data would be contiguous
+  // With it the column data better fits in the same cache line
+  // Also we would be able to quickly pick the data into a vector register in CPU instead of having to gather from all over the memory
+  Matrix<T> bt = {
+    .rows = b.cols,
+    .cols = b.rows,
+    .data = vector<T>(b.rows * b.cols)
+  };
+  for (int i=0; i<b.rows; i++) {
+    for (int j=0; j<b.cols; j++) {
+      bt.data[j * bt.cols + i] = b.data[i * b.cols + j];
+    }
+  }
+  Matrix<T> ans = {
+    .rows = a.rows,
+    .cols = b.cols,
+    .data = vector<T>(a.rows * b.cols)
+  };
+  for (int r=0; r<a.rows; r++) {
+    for (int c=0; c<b.cols; c++) {
+      T s = 0;
+      int i = 0;
+      while (i + L <= a.cols) {
+        auto rownums = V::load(&a.data[r * a.cols + i]);
+        auto colnums = V::load(&bt.data[c * bt.cols + i]);
+        auto mults = V::mul(rownums, colnums);
+
+        // Pull the multipled result from CPU into memory
+        // alignment ensures all the bits of the data will fit in a CPU cache, avoiding multiple pulls when the data crosses cache boundary
+        alignas(64) T temp[L];
+        V::store(temp, mults);
+
+        // usually modern compilers can vectorize simple additions like this
+        // so not manually calling the intrinsics
+        for (int t=0; t<L; t++) {
+          s += temp[t];
+        }
+        i += L;
+      }
+      while (i < a.cols) {
+        s += a.data[r * a.cols + i] * bt.data[c * bt.cols + i];
+        i++;
+      }
+      ans.data[r * ans.cols + c] = s;
+    }
+  }
+  return ans;
+}
+
+// GotoBLAS / BLIS style matmul.
+// simd_matmul2 still computes one output number at a time: LANES products, stored to memory, summed up with scalar code.
+// Here the output is computed in MR x NR tiles whose partial sums never leave the vector registers,
+// every loaded b vector is used MR times and every broadcast a number 2 times before it's dropped.
+//
+// To keep the micro-kernel fed from the caches the loops are blocked:
+// - a KC x NC block of b is packed (copied) into panels of NR columns, it stays in L3
+// - a MC x KC block of a is packed into panels of MR rows, it stays in L2
+// - the micro-kernel streams one a panel (MR x KC) and one b panel (KC x NR, stays in L1) through the registers
+// Packing puts the numbers in exactly the order the micro-kernel reads them, so its loads are contiguous
+// and the edges of the matrices are padded with zeros instead of special cased in the hot loop.
+namespace blocked {
+
+// the tile of the output kept in registers, 6 rows x 2 vector registers = 12 accumulators + 2 for b + 1 for a.
+// NR is 2 vectors, with AVX2 16 ints or floats and 8 doubles
+constexpr int MR = 6;
+template<typename T>
+constexpr int NR = 2 * Simd<T>::LANES;
+// cache blocking (for AVX2, the panels of b are half as big with SSE and twice as big with AVX-512):
+// a KC x NR panel of b (16 KB) fits in L1, MC x KC of a (96 KB, 192 KB for doubles) in L2,
+// KC x NC of b (2 MB, 4 MB for doubles) in L3
+constexpr int KC = 256;
+constexpr int MC = 96;
+constexpr int NC = 2048;
+
+// b[pc .. pc+kc) x [jc .. jc+nc) into panels of NR columns, each panel row after row.
+// Only every panel_step-th panel from first_panel on, so that several threads can pack one block together.
+// ldb is the row length of b.
+template<typename T>
+KERNEL_TARGET void pack_b(const T* b, int ldb, int pc, int kc, int jc, int nc, vector<T>& packed, int first_panel = 0, int panel_step = 1) {
+  constexpr int nr = NR<T>;
+  for (int jr=first_panel*nr; jr<nc; jr+=panel_step*nr) {
+    T* dst = &packed[jr * kc];
+    const int cols = min(nr, nc - jr);
+    for (int p=0; p<kc; p++) {
+      const T* src = &b[(pc + p) * ldb + jc + jr];
+      int j = 0;
+      for (; j<cols; j++) {
+        dst[j] = src[j];
+      }
+      for (; j<nr; j++) {
+        dst[j] = 0;
+      }
+      dst += nr;
+    }
+  }
+}
+
+// a[ic .. ic+mc) x [pc .. pc+kc) into panels of MR rows, each panel column after column, lda is the row length of a
+template<typename T>
+KERNEL_TARGET void pack_a(const T* a, int lda, int ic, int mc, int pc, int kc, vector<T>& packed) {
+  T* dst = packed.data();
+  for (int ir=0; ir<mc; ir+=MR) {
+    const int rows = min(MR, mc - ir);
+    for (int p=0; p<kc; p++) {
+      int i = 0;
+      for (; i<rows; i++) {
+        dst[i] = a[(ic + ir + i) * lda + pc + p];
+      }
+      for (; i<MR; i++) {
+        dst[i] = 0;
+      }
+      dst += MR;
+    }
+  }
+}
+
+// c[0 .. rows) x [0 .. cols) += a_panel (MR x kc) * b_panel (kc x NR), ldc is the row length of c
+template<typename T>
+KERNEL_TARGET void micro_kernel(int kc, const T* a_panel, const T* b_panel, T* c, int ldc, int rows, int cols) {
+  using V = Simd<T>;
+  constexpr int L = V::LANES;
+  constexpr int nr = NR<T>;
+  typename V::Vec acc[MR][2];
+  for (int i=0; i<MR; i++) {
+    acc[i][0] = V::zero();
+    acc[i][1] = V::zero();
+  }
+  // MR and NR are constants, the compiler unrolls the loops over them and keeps acc in registers
+  for (int p=0; p<kc; p++) {
+    const auto b0 = V::load(&b_panel[p * nr]);
+    const auto b1 = V::load(&b_panel[p * nr + L]);
+    for (int i=0; i<MR; i++) {
+      const auto a_num = V::broadcast(a_panel[p * MR + i]);
+      acc[i][0] = V::mul_add(a_num, b0, acc[i][0]);
+      acc[i][1] = V::mul_add(a_num, b1, acc[i][1]);
+    }
+  }
+  if (rows == MR && cols == nr) {
+    for (int i=0; i<MR; i++) {
+      T* c0 = &c[i * ldc];
+      T* c1 = &c[i * ldc + L];
+      V::store(c0, V::add(V::load(c0), acc[i][0]));
+      V::store(c1, V::add(V::load(c1), acc[i][1]));
+    }
+    return;
+  }
+  // a tile at the edge, only part of it is inside of c
+  alignas(64) T tile[MR * nr];
+  for (int i=0; i<MR; i++) {
+    V::store(&tile[i * nr], acc[i][0]);
+    V::store(&tile[i * nr + L], acc[i][1]);
+  }
+  for (int i=0; i<rows; i++) {
+    for (int j=0; j<cols; j++) {
+      c[i * ldc + j] += tile[i * nr + j];
+    }
+  }
+}
+
+}
+
+// c += a * b for an m x k a and a k x n b, lda, ldb and ldc being the row lengths, so blocks of bigger matrices work too.
+// The packing buffers are the caller's, they are grown to full blocks on the first call and reused by the next ones.
+template<typename T>
+KERNEL_TARGET void blocked_multiply_add(int m, int k, int n, const T* a, int lda, const T* b, int ldb, T* c, int ldc,
+                                        vector<T>& packed_a, vector<T>& packed_b) {
+  using namespace blocked;
+  constexpr int nr = NR<T>;
+  // sized for full blocks, rounded up to whole panels
+  if (packed_a.size() < (size_t)MC * KC) {
+    packed_a.resize(MC * KC);
+  }
+  if (packed_b.size() < (size_t)(NC + nr - 1) / nr * nr * KC) {
+    packed_b.resize((NC + nr - 1) / nr * nr * KC);
+  }
+  for (int jc=0; jc<n; jc+=NC) {
+    const int nc = min(NC, n - jc);
+    for (int pc=0; pc<k; pc+=KC) {
+      const int kc = min(KC, k - pc);
+      pack_b(b, ldb, pc, kc, jc, nc, packed_b);
+      for (int ic=0; ic<m; ic+=MC) {
+        const int mc = min(MC, m - ic);
+        pack_a(a, lda, ic, mc, pc, kc, packed_a);
+        for (int jr=0; jr<nc; jr+=nr) {
+          for (int ir=0; ir<mc; ir+=MR) {
+            micro_kernel(kc, &packed_a[ir * kc], &packed_b[jr * kc], &c[(ic + ir) * ldc + jc + jr],
+                         ldc, min(MR, mc - ir), min(nr, nc - jr));
+          }
+        }
+      }
+    }
+  }
+}
+
+template<typename T>
+KERNEL_TARGET Matrix<T> blocked_matmul(const Matrix<T>& a, const Matrix<T>& b) {
+  assert(a.cols == b.rows);
+  Matrix<T> ans = {
+    .rows = a.rows,
+    .cols = b.cols,
+    .data = vector<T>(a.rows * b.cols)
+  };
+  vector<T> packed_a;
+  vector<T> packed_b;
+  blocked_multiply_add(a.rows, a.cols, b.cols, a.data.data(), a.cols, b.data.data(), b.cols, ans.data.data(), ans.cols,
+                       packed_a, packed_b);
+  return ans;
+}
+
+
+// blocked_matmul() on all the threads of the pool.
+// For every KC x NC block of b the threads first pack it together (every thread some of the panels)
+// into one buffer they all share, so b is read from memory once and not once per thread.
+// Then the block's part of the output is cut into MC x TILE_N tiles which the threads grab one by one,
+// a tile belongs to one thread only so nobody writes the same output numbers. Each thread packs
+// the a block of its tile into its own buffer, and doesn't repack it when the next tile it grabs is on the same rows.
+// A barrier after each phase: nobody computes with half packed b, and nobody repacks b while it's still being used.
+namespace parallel {
+
+// wide enough to keep a packed a block busy for a while, narrow enough for plenty of tiles
+constexpr int TILE_N = 128;
+
+}
+
+template<typename T>
+KERNEL_TARGET Matrix<T> parallel_matmul(ThreadPool& pool, const Matrix<T>& a, const Matrix<T>& b) {
+  using namespace blocked;
+  using parallel::TILE_N;
+  constexpr int nr = NR<T>;
+  assert(a.cols == b.rows);
+  Matrix<T> ans = {
+    .rows = a.rows,
+    .cols = b.cols,
+    .data = vector<T>(a.rows * b.cols)
+  };
+  const int num_threads = pool.size();
+  vector<T> packed_b((NC + nr - 1) / nr * nr * KC);
+  vector<vector<T>> packed_a(num_threads, vector<T>(MC * KC));
+  atomic<int> next_tile = 0;
+  // the next phase hands out the tiles from the start again
+  barrier sync(num_threads, [&]() noexcept { next_tile = 0; });
+  const int row_blocks = (a.rows + MC - 1) / MC;
+
+  pool.run([&](int thread_index) {
+    for (int jc=0; jc<b.cols; jc+=NC) {
+      const int nc = min(NC, b.cols - jc);
+      const int col_tiles = (nc + TILE_N - 1) / TILE_N;
+      for (int pc=0; pc<a.cols; pc+=KC) {
+        const int kc = min(KC, a.cols - pc);
+        pack_b(b.data.data(), b.cols, pc, kc, jc, nc, packed_b, thread_index, num_threads);
+        sync.arrive_and_wait();
+        // row after row, a thread grabbing consecutive tiles keeps its packed a
+        int packed_ic = -1;
+        for (int tile = next_tile++; tile < row_blocks * col_tiles; tile = next_tile++) {
+          const int ic = tile / col_tiles * MC;
+          const int mc = min(MC, a.rows - ic);
+          const int j_start = tile % col_tiles * TILE_N;
+          const int j_end = min(j_start + TILE_N, nc);
+          if (ic != packed_ic) {
+            pack_a(a.data.data(), a.cols, ic, mc, pc, kc, packed_a[thread_index]);
+            packed_ic = ic;
+          }
+          for (int jr=j_start; jr<j_end; jr+=nr) {
+            for (int ir=0; ir<mc; ir+=MR) {
+              micro_kernel(kc, &packed_a[thread_index][ir * kc], &packed_b[jr * kc],
+                           &ans.data[(ic + ir) * ans.cols + jc + jr], ans.cols, min(MR, mc - ir), min(nr, j_end - jr));
+            }
+          }
+        }
+        sync.arrive_and_wait();
+      }
+    }
+  });
+  return ans;
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <immintrin.h>
+
+// The vector instructions of every ISA level, one Simd<T> per element type and level.
+// The kernels in simd_kernels.hpp are written once against these and compiled once per level, see dispatch.hpp.
+//
+// The binary is built for plain x86-64 (no -mavx2), so that it starts on any x86 cpu.
+// The functions using newer instructions say so with a target attribute instead,
+// the compiler then uses those instructions in them (and only in them).
+// Calling one of them on a cpu without the instructions is a SIGILL, the dispatcher makes sure nobody does.
+//
+// ints multiply and add in two instructions (and ignore overflow, the result wraps around),
+// floats and doubles in AVX2 and AVX-512 do both in one fused multiply add (FMA), which also rounds only once.
+// availabe intrinsics:
+// https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+
+#define TARGET_SSE41 [[gnu::target("sse4.1")]]
+#define TARGET_AVX2 [[gnu::target("avx2,fma")]]
+#define TARGET_AVX512 [[gnu::target("avx512f,avx2,fma")]]
+
+
+// no vector instructions, 4 lanes in a plain array.
+// The compiler still vectorizes the loops over them with SSE2, which every x86-64 cpu has
+namespace scalar {
+
+template<typename T>
+struct Simd {
+  static constexpr int LANES = 4;
+  struct Vec {
+    T lanes[LANES];
+  };
+
+  static Vec zero() {
+    return {};
+  }
+  static Vec load(const T* p) {
+    Vec v;
+    for (int i=0; i<LANES; i++) {
+      v.lanes[i] = p[i];
+    }
+    return v;
+  }
+  static void store(T* p, Vec v) {
+    for (int i=0; i<LANES; i++) {
+      p[i] = v.lanes[i];
+    }
+  }
+  static Vec broadcast(T x) {
+    Vec v;
+    for (int i=0; i<LANES; i++) {
+      v.lanes[i] = x;
+    }
+    return v;
+  }
+  static Vec add(Vec a, Vec b) {
+    for (int i=0; i<LANES; i++) {
+      a.lanes[i] += b.lanes[i];
+    }
+    return a;
+  }
+  static Vec mul(Vec a, Vec b) {
+    for (int i=0; i<LANES; i++) {
+      a.lanes[i] *= b.lanes[i];
+    }
+    return a;
+  }
+  // acc + a * b
+  static Vec mul_add(Vec a, Vec b, Vec acc) {
+    return add(acc, mul(a, b));
+  }
+  // LANES numbers, stride numbers apart from each other
+  static Vec gather(const T* p, int stride) {
+    Vec v;
+    for (int i=0; i<LANES; i++) {
+      v.lanes[i] = p[i * stride];
+    }
+    return v;
+  }
+};
+
+}
+
+
+// 128 bit registers. SSE4.1 brought the 32 bit multiply (_mm_mullo_epi32), there is no FMA and no gather yet
+namespace sse41 {
+
+template<typename T>
+struct Simd;
+
+template<>
+struct Simd<int> {
+  using Vec = __m128i;
+  static constexpr int LANES = 4;
+
+  TARGET_SSE41 static Vec zero() { return _mm_setzero_si128(); }
+  TARGET_SSE41 static Vec load(const int* p) { return _mm_loadu_si128((const __m128i *) p); }
+  TARGET_SSE41 static void store(int* p, Vec v) { _mm_storeu_si128((__m128i *) p, v); }
+  TARGET_SSE41 static Vec broadcast(int x) { return _mm_set1_epi32(x); }
+  TARGET_SSE41 static Vec add(Vec a, Vec b) { return _mm_add_epi32(a, b); }
+  TARGET_SSE41 static Vec mul(Vec a, Vec b) { return _mm_mullo_epi32(a, b); }
+  TARGET_SSE41 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm_add_epi32(acc, _mm_mullo_epi32(a, b)); }
+  TARGET_SSE41 static Vec gather(const int* p, int stride) { return _mm_setr_epi32(p[0], p[stride], p[stride * 2], p[stride * 3]); }
+};
+
+template<>
+struct Simd<float> {
+  using Vec = __m128;
+  static constexpr int LANES = 4;
+
+  TARGET_SSE41 static Vec zero() { return _mm_setzero_ps(); }
+  TARGET_SSE41 static Vec load(const float* p) { return _mm_loadu_ps(p); }
+  TARGET_SSE41 static void store(float* p, Vec v) { _mm_storeu_ps(p, v); }
+  TARGET_SSE41 static Vec broadcast(float x) { return _mm_set1_ps(x); }
+  TARGET_SSE41 static Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+  TARGET_SSE41 static Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+  TARGET_SSE41 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm_add_ps(acc, _mm_mul_ps(a, b)); }
+  TARGET_SSE41 static Vec gather(const float* p, int stride) { return _mm_setr_ps(p[0], p[stride], p[stride * 2], p[stride * 3]); }
+};
+
+template<>
+struct Simd<double> {
+  using Vec = __m128d;
+  static constexpr int LANES = 2;
+
+  TARGET_SSE41 static Vec zero() { return _mm_setzero_pd(); }
+  TARGET_SSE41 static Vec load(const double* p) { return _mm_loadu_pd(p); }
+  TARGET_SSE41 static void store(double* p, Vec v) { _mm_storeu_pd(p, v); }
+  TARGET_SSE41 static Vec broadcast(double x) { return _mm_set1_pd(x); }
+  TARGET_SSE41 static Vec add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+  TARGET_SSE41 static Vec mul(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+  TARGET_SSE41 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm_add_pd(acc, _mm_mul_pd(a, b)); }
+  TARGET_SSE41 static Vec gather(const double* p, int stride) { return _mm_setr_pd(p[0], p[stride]); }
+};
+
+}
+
+
+// 256 bit registers
+namespace avx2 {
+
+template<typename T>
+struct Simd;
+
+template<>
+struct Simd<int> {
+  using Vec = __m256i;
+  static constexpr int LANES = 8;
+
+  TARGET_AVX2 static Vec zero() { return _mm256_setzero_si256(); }
+  TARGET_AVX2 static Vec load(const int* p) { return _mm256_loadu_si256((const __m256i *) p); }
+  TARGET_AVX2 static void store(int* p, Vec v) { _mm256_storeu_si256((__m256i *) p, v); }
+  TARGET_AVX2 static Vec broadcast(int x) { return _mm256_set1_epi32(x); }
+  TARGET_AVX2 static Vec add(Vec a, Vec b) { return _mm256_add_epi32(a, b); }
+  TARGET_AVX2 static Vec mul(Vec a, Vec b) { return _mm256_mullo_epi32(a, b); }
+  TARGET_AVX2 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm256_add_epi32(acc, _mm256_mullo_epi32(a, b)); }
+  // Scaling by 4 as ints take 4 bytes
+  TARGET_AVX2 static Vec gather(const int* p, int stride) {
+    __m256i indices = _mm256_setr_epi32(0, stride, stride * 2, stride * 3, stride * 4, stride * 5, stride * 6, stride * 7);
+    return _mm256_i32gather_epi32(p, indices, 4);
+  }
+};
+
+template<>
+struct Simd<float> {
+  using Vec = __m256;
+  static constexpr int LANES = 8;
+
+  TARGET_AVX2 static Vec zero() { return _mm256_setzero_ps(); }
+  TARGET_AVX2 static Vec load(const float* p) { return _mm256_loadu_ps(p); }
+  TARGET_AVX2 static void store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+  TARGET_AVX2 static Vec broadcast(float x) { return _mm256_set1_ps(x); }
+  TARGET_AVX2 static Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+  TARGET_AVX2 static Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+  TARGET_AVX2 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm256_fmadd_ps(a, b, acc); }
+  TARGET_AVX2 static Vec gather(const float* p, int stride) {
+    __m256i indices = _mm256_setr_epi32(0, stride, stride * 2, stride * 3, stride * 4, stride * 5, stride * 6, stride * 7);
+    return _mm256_i32gather_ps(p, indices, 4);
+  }
+};
+
+template<>
+struct Simd<double> {
+  using Vec = __m256d;
+  static constexpr int LANES = 4;
+
+  TARGET_AVX2 static Vec zero() { return _mm256_setzero_pd(); }
+  TARGET_AVX2 static Vec load(const double* p) { return _mm256_loadu_pd(p); }
+  TARGET_AVX2 static void store(double* p, Vec v) { _mm256_storeu_pd(p, v); }
+  TARGET_AVX2 static Vec broadcast(double x) { return _mm256_set1_pd(x); }
+  TARGET_AVX2 static Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+  TARGET_AVX2 static Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+  TARGET_AVX2 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm256_fmadd_pd(a, b, acc); }
+  TARGET_AVX2 static Vec gather(const double* p, int stride) {
+    __m128i indices = _mm_setr_epi32(0, stride, stride * 2, stride * 3);
+    return _mm256_i32gather_pd(p, indices, 8);
+  }
+};
+
+}
+
+
+// 512 bit registers, and 32 of them instead of 16
+namespace avx512 {
+
+template<typename T>
+struct Simd;
+
+template<>
+struct Simd<int> {
+  using Vec = __m512i;
+  static constexpr int LANES = 16;
+
+  TARGET_AVX512 static Vec zero() { return _mm512_setzero_si512(); }
+  TARGET_AVX512 static Vec load(const int* p) { return _mm512_loadu_si512(p); }
+  TARGET_AVX512 static void store(int* p, Vec v) { _mm512_storeu_si512(p, v); }
+  TARGET_AVX512 static Vec broadcast(int x) { return _mm512_set1_epi32(x); }
+  TARGET_AVX512 static Vec add(Vec a, Vec b) { return _mm512_add_epi32(a, b); }
+  TARGET_AVX512 static Vec mul(Vec a, Vec b) { return _mm512_mullo_epi32(a, b); }
+  TARGET_AVX512 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm512_add_epi32(acc, _mm512_mullo_epi32(a, b)); }
+  TARGET_AVX512 static Vec gather(const int* p, int stride) {
+    __m512i indices = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                         _mm512_set1_epi32(stride));
+    return _mm512_i32gather_epi32(indices, p, 4);
+  }
+};
+
+template<>
+struct Simd<float> {
+  using Vec = __m512;
+  static constexpr int LANES = 16;
+
+  TARGET_AVX512 static Vec zero() { return _mm512_setzero_ps(); }
+  TARGET_AVX512 static Vec load(const float* p) { return _mm512_loadu_ps(p); }
+  TARGET_AVX512 static void store(float* p, Vec v) { _mm512_storeu_ps(p, v); }
+  TARGET_AVX512 static Vec broadcast(float x) { return _mm512_set1_ps(x); }
+  TARGET_AVX512 static Vec add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+  TARGET_AVX512 static Vec mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+  TARGET_AVX512 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm512_fmadd_ps(a, b, acc); }
+  TARGET_AVX512 static Vec gather(const float* p, int stride) {
+    __m512i indices = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                         _mm512_set1_epi32(stride));
+    return _mm512_i32gather_ps(indices, p, 4);
+  }
+};
+
+template<>
+struct Simd<double> {
+  using Vec = __m512d;
+  static constexpr int LANES = 8;
+
+  TARGET_AVX512 static Vec zero() { return _mm512_setzero_pd(); }
+  TARGET_AVX512 static Vec load(const double* p) { return _mm512_loadu_pd(p); }
+  TARGET_AVX512 static void store(double* p, Vec v) { _mm512_storeu_pd(p, v); }
+  TARGET_AVX512 static Vec broadcast(double x) { return _mm512_set1_pd(x); }
+  TARGET_AVX512 static Vec add(Vec a, Vec b) { return _mm512_add_pd(a, b); }
+  TARGET_AVX512 static Vec mul(Vec a, Vec b) { return _mm512_mul_pd(a, b); }
+  TARGET_AVX512 static Vec mul_add(Vec a, Vec b, Vec acc) { return _mm512_fmadd_pd(a, b, acc); }
+  TARGET_AVX512 static Vec gather(const double* p, int stride) {
+    __m256i indices = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    return _mm512_i32gather_pd(indices, p, 8);
+  }
+};
+
+}
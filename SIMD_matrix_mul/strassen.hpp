@@ -0,0 +1,244 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include <algorithm>
+#include "matrix.hpp"
+#include "dispatch.hpp"
+
+// Strassen's multiplication in Winograd's variant: 7 products of half sized blocks and 15 additions
+// instead of 8 products, O(n^2.81) instead of O(n^3).
+// The additions are only memory bound passes over the blocks, so below some size
+// the blocked SIMD kernel (blocked_matmul) is faster than splitting further, that's STRASSEN_CUTOFF.
+//
+// Every split needs even sizes. Instead of peeling odd rows and columns off at every level,
+// the matrices are zero padded once up front to multiples of 2^levels,
+// (less than 2^levels extra rows / columns, the padding adds zeros to the products and is cut off at the end).
+// The blocks are views into the padded matrices, the temporaries of every level come from one arena
+// allocated up front and handed out like a stack. The leaves run blocked_matmul()'s kernel right on the views
+// (blocked_multiply_add()) with one pair of packing buffers for all of them, so after the first leaf nothing allocates
+// and nothing is copied besides the packing the kernel does anyway.
+// Works for rectangular shapes too, every dimension is halved at every level.
+namespace strassen {
+
+// below this many rows, columns or inner products per block blocked_matmul takes over.
+// The winner of the cutoff sweep at the end of matmul.cpp ([2048, 2048] floats, AVX-512, one core, best of 5),
+// over a few runs: 1024 at 0.98x - 1.02x of blocked_matmul, 512 at 0.93x - 0.98x, 256 at 0.82x - 0.89x,
+// and 1024 was still even with it at [4096, 4096]. So shapes below 2048 go straight to blocked_matmul.
+// Even at 1024 Strassen doesn't clearly win on that box (benchmark_strassen() has it at about 0.9x):
+// the leaves read strided blocks, which costs blocked_matmul's kernel about 15%, and that plus the additions
+// eats the 1/8 of the flops a split saves. Rerun the sweep on other machines, built with -O3 and without
+// compile.sh's -fsanitize=address, which slows the additions and the kernel by different amounts.
+constexpr int STRASSEN_CUTOFF = 1024;
+
+// a block of a matrix: rows x cols numbers, stride numbers from the start of one row to the next
+template<typename T>
+struct View {
+  T* data;
+  int rows;
+  int cols;
+  int stride;
+
+  T& at(int r, int c) const {
+    return data[r * stride + c];
+  }
+
+  // quadrant (i, j) of the 2 x 2 split, the sizes are even
+  View quadrant(int i, int j) const {
+    return {data + i * (rows / 2) * stride + j * (cols / 2), rows / 2, cols / 2, stride};
+  }
+};
+
+template<typename T>
+View<T> view_of(Matrix<T>& m) {
+  return {m.data.data(), m.rows, m.cols, m.cols};
+}
+
+// scratch for the temporaries, allocated once, handed out and given back in stack order
+template<typename T>
+class Arena {
+public:
+  explicit Arena(size_t capacity): buffer(capacity) {}
+
+  View<T> allocate(int rows, int cols) {
+    assert(used + rows * cols <= buffer.size());
+    View<T> view = {buffer.data() + used, rows, cols, cols};
+    used += rows * cols;
+    return view;
+  }
+
+  size_t mark() const {
+    return used;
+  }
+
+  // gives back everything allocated since the mark
+  void release(size_t mark) {
+    used = mark;
+  }
+
+private:
+  vector<T> buffer;
+  size_t used = 0;
+};
+
+template<typename T>
+void add(View<T> x, View<T> y, View<T> out) {
+  for (int r=0; r<out.rows; r++) {
+    const T* x_row = &x.at(r, 0);
+    const T* y_row = &y.at(r, 0);
+    T* out_row = &out.at(r, 0);
+    for (int c=0; c<out.cols; c++) {
+      out_row[c] = x_row[c] + y_row[c];
+    }
+  }
+}
+
+template<typename T>
+void subtract(View<T> x, View<T> y, View<T> out) {
+  for (int r=0; r<out.rows; r++) {
+    const T* x_row = &x.at(r, 0);
+    const T* y_row = &y.at(r, 0);
+    T* out_row = &out.at(r, 0);
+    for (int c=0; c<out.cols; c++) {
+      out_row[c] = x_row[c] - y_row[c];
+    }
+  }
+}
+
+template<typename T>
+struct Scratch {
+  Arena<T> arena;
+  // blocked_multiply_add()'s packing buffers, shared by all the leaves
+  vector<T> packed_a;
+  vector<T> packed_b;
+};
+
+// c = a * b with levels more splits to go
+template<typename T>
+void multiply_into(View<T> a, View<T> b, View<T> c, int levels, Scratch<T>& scratch) {
+  if (levels == 0) {
+    // the kernel adds to c
+    for (int r=0; r<c.rows; r++) {
+      fill(&c.at(r, 0), &c.at(r, 0) + c.cols, T(0));
+    }
+    blocked_multiply_add(a.rows, a.cols, b.cols, a.data, a.stride, b.data, b.stride, c.data, c.stride,
+                         scratch.packed_a, scratch.packed_b);
+    return;
+  }
+  const size_t mark = scratch.arena.mark();
+  const int m = a.rows / 2;
+  const int k = a.cols / 2;
+  const int n = b.cols / 2;
+  View<T> a11 = a.quadrant(0, 0), a12 = a.quadrant(0, 1), a21 = a.quadrant(1, 0), a22 = a.quadrant(1, 1);
+  View<T> b11 = b.quadrant(0, 0), b12 = b.quadrant(0, 1), b21 = b.quadrant(1, 0), b22 = b.quadrant(1, 1);
+  View<T> c11 = c.quadrant(0, 0), c12 = c.quadrant(0, 1), c21 = c.quadrant(1, 0), c22 = c.quadrant(1, 1);
+
+  View<T> s1 = scratch.arena.allocate(m, k), s2 = scratch.arena.allocate(m, k);
+  View<T> s3 = scratch.arena.allocate(m, k), s4 = scratch.arena.allocate(m, k);
+  View<T> t1 = scratch.arena.allocate(k, n), t2 = scratch.arena.allocate(k, n);
+  View<T> t3 = scratch.arena.allocate(k, n), t4 = scratch.arena.allocate(k, n);
+  View<T> p = scratch.arena.allocate(m, n);
+  add(a21, a22, s1);
+  subtract(s1, a11, s2);
+  subtract(a11, a21, s3);
+  subtract(a12, s2, s4);
+  subtract(b12, b11, t1);
+  subtract(b22, t1, t2);
+  subtract(b22, b12, t3);
+  subtract(t2, b21, t4);
+
+  // the 7 products P1 .. P7 and the sums U1 .. U7 of them, in an order that needs one temporary (p) only,
+  // the quadrants of c hold the partial sums until they are final
+  multiply_into(a11, b11, p, levels - 1, scratch);  // P1
+  multiply_into(a12, b21, c11, levels - 1, scratch);  // P2
+  add(c11, p, c11);  // c11 = U1 = P1 + P2
+  multiply_into(s2, t2, c22, levels - 1, scratch);  // P6
+  add(c22, p, c22);  // U2 = P1 + P6
+  multiply_into(s3, t3, c21, levels - 1, scratch);  // P7
+  add(c21, c22, c21);  // U3 = U2 + P7
+  multiply_into(s1, t1, p, levels - 1, scratch);  // P5
+  add(c22, p, c22);  // U4 = U2 + P5
+  multiply_into(s4, b22, c12, levels - 1, scratch);  // P3
+  add(c12, c22, c12);  // c12 = U5 = U4 + P3
+  add(c21, p, c22);  // c22 = U7 = U3 + P5
+  multiply_into(a22, t4, p, levels - 1, scratch);  // P4
+  subtract(c21, p, c21);  // c21 = U6 = U3 - P4
+  scratch.arena.release(mark);
+}
+
+// the most the arena holds at once: the temporaries of every level on the way down to a leaf
+size_t arena_size(int m, int k, int n, int levels) {
+  size_t size = 0;
+  for (int level=0; level<levels; level++) {
+    m /= 2;
+    k /= 2;
+    n /= 2;
+    size += 4 * (size_t)m * k + 4 * (size_t)k * n + (size_t)m * n;
+  }
+  return size;
+}
+
+// rows x cols, a copied into the top left corner and the rest zeros
+template<typename T>
+Matrix<T> padded(const Matrix<T>& a, int rows, int cols) {
+  if (a.rows == rows && a.cols == cols) {
+    return a;
+  }
+  Matrix<T> ans = {
+    .rows = rows,
+    .cols = cols,
+    .data = vector<T>(rows * cols)
+  };
+  for (int r=0; r<a.rows; r++) {
+    copy(&a.data[r * a.cols], &a.data[r * a.cols] + a.cols, &ans.data[r * cols]);
+  }
+  return ans;
+}
+
+}
+
+template<typename T>
+Matrix<T> strassen_matmul(const Matrix<T>& a, const Matrix<T>& b, int cutoff = strassen::STRASSEN_CUTOFF) {
+  using namespace strassen;
+  assert(a.cols == b.rows);
+  // 0 or less would split forever
+  assert(cutoff > 0);
+  // split for as long as the smallest dimension stays at or above the cutoff
+  int levels = 0;
+  while (min({a.rows, a.cols, b.cols}) >> (levels + 1) >= cutoff) {
+    levels++;
+  }
+  if (levels == 0) {
+    return blocked_matmul(a, b);
+  }
+  auto round_up = [&](int size) { return (size + (1 << levels) - 1) >> levels << levels; };
+  const int m = round_up(a.rows);
+  const int k = round_up(a.cols);
+  const int n = round_up(b.cols);
+  Matrix<T> padded_a = padded(a, m, k);
+  Matrix<T> padded_b = padded(b, k, n);
+  Matrix<T> ans = {
+    .rows = m,
+    .cols = n,
+    .data = vector<T>(m * n)
+  };
+  Scratch<T> scratch = {
+    .arena = Arena<T>(arena_size(m, k, n, levels)),
+    .packed_a = {},
+    .packed_b = {}
+  };
+  multiply_into(view_of(padded_a), view_of(padded_b), view_of(ans), levels, scratch);
+  if (m == a.rows && n == b.cols) {
+    return ans;
+  }
+  // cut the padding off
+  Matrix<T> cropped = {
+    .rows = a.rows,
+    .cols = b.cols,
+    .data = vector<T>(a.rows * b.cols)
+  };
+  for (int r=0; r<a.rows; r++) {
+    copy(&ans.data[r * n], &ans.data[r * n] + b.cols, &cropped.data[r * b.cols]);
+  }
+  return cropped;
+}
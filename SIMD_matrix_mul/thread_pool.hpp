@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+
+// A fixed set of threads, started once and reused by every parallel_matmul() instead of spawning threads per product
+class ThreadPool {
+public:
+  explicit ThreadPool(int num_threads) {
+    for (int i=0; i<num_threads; i++) {
+      threads.emplace_back([this, i]() { work(i); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      lock_guard lk(mtx);
+      stopping = true;
+    }
+    start_cv.notify_all();
+    for (auto& t: threads) {
+      t.join();
+    }
+  }
+
+  int size() const {
+    return threads.size();
+  }
+
+  // runs job(thread_index) on every thread of the pool, returns once all of them are done
+  void run(function<void(int)> job) {
+    unique_lock lk(mtx);
+    current_job = move(job);
+    running = threads.size();
+    generation++;
+    start_cv.notify_all();
+    done_cv.wait(lk, [this]() { return running == 0; });
+  }
+
+private:
+  vector<thread> threads;
+  mutex mtx;
+  condition_variable start_cv;
+  condition_variable done_cv;
+  function<void(int)> current_job;
+  // bumped for every run() so that a thread runs each job exactly once
+  long long generation = 0;
+  int running = 0;
+  bool stopping = false;
+
+  void work(int thread_index) {
+    long long done_generation = 0;
+    while (true) {
+      unique_lock lk(mtx);
+      start_cv.wait(lk, [&]() { return stopping || generation != done_generation; });
+      if (stopping) {
+        return;
+      }
+      done_generation = generation;
+      lk.unlock();
+      current_job(thread_index);
+      lk.lock();
+      if (--running == 0) {
+        done_cv.notify_one();
+      }
+    }
+  }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Test hook: replaces the global operator new so that the tests can check
+// how many heap allocations a piece of code did.
+// Only include it in the test binary (test.hpp does), it affects every allocation of the program.
+// bench.cpp and benchmark.hpp stay clear of it.
+//
+// The whole family is replaced, plain, array, nothrow and over-aligned, so that every new goes through the counter
+// and every delete has a replacement matching its new (gcc's -Wmismatched-new-delete checks the pairs).
+namespace test {
+
+inline std::atomic<long long> allocations = 0;
+
+inline void* counted_alloc(std::size_t size, std::align_val_t align) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  const std::size_t alignment = static_cast<std::size_t>(align);
+  if (size == 0) {
+    size = 1;
+  }
+  if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    return std::malloc(size);
+  }
+  // aligned_alloc() wants the size to be a multiple of the alignment
+  return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+inline void counted_free(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+inline void* counted_alloc_or_throw(std::size_t size, std::align_val_t align) {
+  if (void* ptr = counted_alloc(size, align)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+}
+
+void* operator new(std::size_t size) {
+  return test::counted_alloc_or_throw(size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void* operator new[](std::size_t size) {
+  return test::counted_alloc_or_throw(size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+  return test::counted_alloc_or_throw(size, align);
+}
+
+void* operator new[](std::size_t size, std::align_val_t align) {
+  return test::counted_alloc_or_throw(size, align);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return test::counted_alloc(size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return test::counted_alloc(size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return test::counted_alloc(size, align);
+}
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return test::counted_alloc(size, align);
+}
+
+void operator delete(void* ptr) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  test::counted_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  test::counted_free(ptr);
+}
@@ -0,0 +1,316 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <cstdio>
+#include <functional>
+#include <unistd.h>
+#include "sequential.hpp"
+#include "concurrent.hpp"
+#include "distributions.hpp"
+#include "simd_partition.hpp"
+#include "benchmark.hpp"
+
+// The benchmark suite, built optimized and without sanitizers by compile_bench.sh.
+// main.cpp only runs the tests, under ThreadSanitizer at -O0 (compile.sh).
+// Doesn't include test.hpp, its allocation counter replaces the global operator new.
+//
+// Every combination of distribution, size, thread count and engine is sorted warmups + repetitions times
+// (always from the same unsorted input) and reported as median / p95 time per sort and elements per second.
+// Tiny inputs are sorted many times per sample so that a sample is long enough to measure.
+//
+// ./build/bench [--distributions uniform,zipf] [--sizes 10,1000000] [--threads 1,4]
+//               [--engines sequential,quicksort,radix] [--warmups 1] [--repetitions 5]
+//               [--json results.json] [--csv results.csv]
+//
+// --sections all (or e.g. scaling,merging) runs those comparisons of benchmark.hpp instead of the sweep.
+// --external-sort 536870912 sorts a file of that many ints (2GB) in the temp directory instead,
+// beyond memory it takes as much disk space three times over.
+
+using namespace std;
+
+
+struct Options {
+  vector<string> distributions = distributions::ALL;
+  vector<size_t> sizes = {10, 100, 1000, 10'000, 100'000, 1'000'000, 10'000'000, 100'000'000, 1'000'000'000};
+  vector<int> threads;
+  vector<string> engines = {"sequential", "quicksort", "radix"};
+  int warmups = 1;
+  int repetitions = 5;
+  string json_path;
+  string csv_path;
+  vector<string> sections;
+  size_t external_sort_size = 0;
+};
+
+struct Result {
+  string distribution;
+  size_t size;
+  int threads;
+  string engine;
+  int repetitions;
+  size_t sorts_per_sample;
+  double median_ns;
+  double p95_ns;
+  double min_ns;
+  double elements_per_second;
+};
+
+
+vector<string> split(const string& list) {
+  vector<string> parts;
+  stringstream ss(list);
+  string part;
+  while (getline(ss, part, ',')) {
+    parts.push_back(part);
+  }
+  return parts;
+}
+
+Options parse_options(int argc, char** argv) {
+  Options options;
+  for (int i=1; i < argc; i++) {
+    const string arg = argv[i];
+    if (i + 1 >= argc) {
+      throw invalid_argument("Missing value for " + arg);
+    }
+    const string value = argv[++i];
+    if (arg == "--distributions") {
+      options.distributions = split(value);
+    } else if (arg == "--sizes") {
+      options.sizes.clear();
+      for (auto& size: split(value)) {
+        options.sizes.push_back(static_cast<size_t>(stod(size)));
+      }
+    } else if (arg == "--threads") {
+      for (auto& threads: split(value)) {
+        options.threads.push_back(stoi(threads));
+      }
+    } else if (arg == "--engines") {
+      options.engines = split(value);
+    } else if (arg == "--warmups") {
+      options.warmups = stoi(value);
+    } else if (arg == "--repetitions") {
+      options.repetitions = max(1, stoi(value));
+    } else if (arg == "--json") {
+      options.json_path = value;
+    } else if (arg == "--csv") {
+      options.csv_path = value;
+    } else if (arg == "--sections") {
+      options.sections = split(value);
+    } else if (arg == "--external-sort") {
+      options.external_sort_size = static_cast<size_t>(stod(value));
+    } else {
+      throw invalid_argument("Unknown option " + arg);
+    }
+  }
+  if (options.threads.empty()) {
+    // 1, 2, 4, ... and all the cpus we can use
+    const int cpus = topology::usable_cpus();
+    for (int threads = 1; threads < cpus; threads *= 2) {
+      options.threads.push_back(threads);
+    }
+    options.threads.push_back(cpus);
+  }
+  return options;
+}
+
+// the comparisons of benchmark.hpp by name, in the order --sections all runs them
+vector<pair<string, function<void(test::RandomGenerator&)>>> benchmark_sections() {
+  return {
+    {"sequential_vs_concurrent", benchmark::sequential_vs_concurrent},
+    {"scaling", benchmark::scaling},
+    {"idle_policies", [](test::RandomGenerator&) { benchmark::idle_policies(); }},
+    {"grain_sizes", benchmark::grain_sizes},
+    {"single_vector", benchmark::single_vector},
+    {"radix_vs_quicksort", benchmark::radix_vs_quicksort},
+    {"partition_kernels", benchmark::partition_kernels},
+    {"leaf_sorts", benchmark::leaf_sorts},
+    {"quadratic_killers", [](test::RandomGenerator&) { benchmark::quadratic_killers(); }},
+    {"overlapping_batches", benchmark::overlapping_batches},
+    {"cancellation", benchmark::cancellation},
+    {"mixed_workload", benchmark::mixed_workload},
+    {"merging", benchmark::merging},
+    {"selection", benchmark::selection},
+    {"element_types", [](test::RandomGenerator&) { benchmark::element_types(); }},
+    {"key_value_sorts", benchmark::key_value_sorts},
+    {"numa_placement", benchmark::numa_placement},
+    {"worker_stats", benchmark::worker_stats},
+  };
+}
+
+// Runs the sections asked for, returns false on an unknown one
+bool run_sections(const vector<string>& names) {
+  const auto sections = benchmark_sections();
+  for (auto& name: names) {
+    if (name != "all" && none_of(sections.begin(), sections.end(), [&](auto& section) { return section.first == name; })) {
+      cerr << "Unknown section " << name << endl;
+      return false;
+    }
+  }
+  test::RandomGenerator rand_gen;
+  for (auto& [name, run]: sections) {
+    if (find(names.begin(), names.end(), "all") != names.end() || find(names.begin(), names.end(), name) != names.end()) {
+      cout << "--------------------------------" << endl;
+      run(rand_gen);
+    }
+  }
+  return true;
+}
+
+size_t physical_memory() {
+  return static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+}
+
+// nearest rank
+double percentile(vector<double> samples, double p) {
+  sort(samples.begin(), samples.end());
+  const size_t rank = static_cast<size_t>(ceil(p * samples.size()));
+  return samples[max<size_t>(rank, 1) - 1];
+}
+
+
+// Times sorts_per_sample sorts of input per sample, returns the time per sort of every repetition in ns.
+// sort_all(copies) sorts all the copies.
+template<typename SortAll>
+vector<double> time_samples(const vector<int>& input, const size_t sorts_per_sample, const Options& options,
+                            SortAll sort_all) {
+  vector<vector<int>> copies(sorts_per_sample);
+  vector<double> samples;
+  for (int rep = 0; rep < options.warmups + options.repetitions; rep++) {
+    for (auto& copy: copies) {
+      copy = input;
+    }
+    const auto start = chrono::steady_clock::now();
+    sort_all(copies);
+    const auto end = chrono::steady_clock::now();
+    if (!is_sorted(copies.front().begin(), copies.front().end())) {
+      throw runtime_error("The sort didn't sort");
+    }
+    if (rep >= options.warmups) {
+      samples.push_back(chrono::duration<double, nano>(end - start).count() / sorts_per_sample);
+    }
+  }
+  return samples;
+}
+
+void write_json(const string& path, const vector<Result>& results) {
+  ofstream out(path);
+  out << "{\n  \"cpus\": " << topology::usable_cpus() << ",\n  \"avx2\": " << (simd::avx2_enabled() ? "true" : "false")
+      << ",\n  \"results\": [\n";
+  for (size_t i=0; i < results.size(); i++) {
+    const Result& r = results[i];
+    out << "    {\"distribution\": \"" << r.distribution << "\", \"size\": " << r.size << ", \"threads\": " << r.threads
+        << ", \"engine\": \"" << r.engine << "\", \"repetitions\": " << r.repetitions
+        << ", \"sorts_per_sample\": " << r.sorts_per_sample << ", \"median_ns\": " << fixed << r.median_ns
+        << ", \"p95_ns\": " << r.p95_ns << ", \"min_ns\": " << r.min_ns
+        << ", \"elements_per_second\": " << r.elements_per_second << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+void write_csv(const string& path, const vector<Result>& results) {
+  ofstream out(path);
+  out << "distribution,size,threads,engine,repetitions,sorts_per_sample,median_ns,p95_ns,min_ns,elements_per_second\n";
+  for (const Result& r: results) {
+    out << r.distribution << "," << r.size << "," << r.threads << "," << r.engine << "," << r.repetitions << ","
+        << r.sorts_per_sample << "," << fixed << r.median_ns << "," << r.p95_ns << "," << r.min_ns << ","
+        << r.elements_per_second << "\n";
+  }
+}
+
+
+int main(int argc, char** argv) {
+  Options options;
+  try {
+    options = parse_options(argc, argv);
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  if (!options.sections.empty()) {
+    return run_sections(options.sections) ? 0 : 1;
+  }
+  if (options.external_sort_size > 0) {
+    benchmark::external_sort(options.external_sort_size);
+    return 0;
+  }
+
+  // one pool per thread count, started up front and reused for everything
+  vector<unique_ptr<concurrent::QuicksortWorkers<>>> pools;
+  for (int threads: options.threads) {
+    pools.push_back(make_unique<concurrent::QuicksortWorkers<>>(threads));
+  }
+
+  vector<Result> results;
+  cout << "distribution   size        threads engine     median ms     p95 ms        Melements/s" << endl;
+  for (const string& distribution: options.distributions) {
+    for (const size_t size: options.sizes) {
+      // the input, the copy being sorted and the radix sort's temporary vector
+      if (3 * size * sizeof(int) > physical_memory() * 8 / 10) {
+        cerr << "skipping " << distribution << " " << size << ", not enough memory" << endl;
+        continue;
+      }
+      const vector<int> input = distributions::generate(distribution, size);
+      // at least ~1M numbers per sample
+      const size_t sorts_per_sample = max<size_t>(1, (size_t(1) << 20) / max<size_t>(size, 1));
+      for (size_t t=0; t < options.threads.size(); t++) {
+        for (const string& engine: options.engines) {
+          // the sequential engine has no threads, run it once
+          if (engine == "sequential" && t > 0) {
+            continue;
+          }
+          vector<double> samples;
+          if (engine == "sequential") {
+            samples = time_samples(input, sorts_per_sample, options, [](vector<vector<int>>& copies) {
+              for (auto& copy: copies) {
+                sequential::quicksort_sequential(0, static_cast<int>(copy.size()) - 1, copy);
+              }
+            });
+          } else if (engine == "quicksort" || engine == "radix") {
+            const auto sort_engine = engine == "radix" ? concurrent::Engine::radix : concurrent::Engine::quicksort;
+            samples = time_samples(input, sorts_per_sample, options, [&](vector<vector<int>>& copies) {
+              pools[t]->sort_batch(copies, sort_engine);
+            });
+          } else {
+            cerr << "Unknown engine " << engine << endl;
+            return 1;
+          }
+          Result result{
+            .distribution = distribution,
+            .size = size,
+            .threads = engine == "sequential" ? 1 : options.threads[t],
+            .engine = engine,
+            .repetitions = options.repetitions,
+            .sorts_per_sample = sorts_per_sample,
+            .median_ns = percentile(samples, 0.5),
+            .p95_ns = percentile(samples, 0.95),
+            .min_ns = *min_element(samples.begin(), samples.end()),
+            .elements_per_second = 0
+          };
+          result.elements_per_second = result.median_ns > 0 ? size * 1e9 / result.median_ns : 0;
+          results.push_back(result);
+          printf("%-14s %-11zu %-7d %-10s %-13.4f %-13.4f %.1f\n", distribution.c_str(), size, result.threads,
+                 engine.c_str(), result.median_ns / 1e6, result.p95_ns / 1e6, result.elements_per_second / 1e6);
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  for (auto& pool: pools) {
+    pool->kill_workers();
+  }
+
+  if (!options.json_path.empty()) {
+    write_json(options.json_path, results);
+  }
+  if (!options.csv_path.empty()) {
+    write_csv(options.csv_path, results);
+  }
+  return 0;
+}
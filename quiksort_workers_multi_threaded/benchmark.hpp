@@ -0,0 +1,650 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <ctime>
+#include <string>
+#include <iomanip>
+#include <limits>
+#include <future>
+#include <cstdint>
+#include <functional>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <array>
+#include <cstdio>
+#include "sequential.hpp"
+#include "concurrent.hpp"
+#include "random_generator.hpp"
+#include "radix.hpp"
+#include "merge.hpp"
+#include "stats.hpp"
+#include "simd_partition.hpp"
+#include "sorting_network.hpp"
+#include "external.hpp"
+#include "distributions.hpp"
+#include "key_value.hpp"
+
+namespace benchmark {
+
+using namespace std;
+
+
+template<typename Func>
+long long time_ms(Func func) {
+  auto start = chrono::high_resolution_clock::now();
+  func();
+  auto end = chrono::high_resolution_clock::now();
+  return chrono::duration_cast<chrono::milliseconds>(end - start).count();
+}
+
+
+vector<vector<int>> generate_batch(test::RandomGenerator& rand_gen, int vectors, int max_size, int max_val) {
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<vectors; i++) {
+    const int sz = rand_gen.generate_random_number(1, max_size);
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, max_val));
+  }
+  return nums_batch;
+}
+
+
+// A few batches of 100 vectors sorted by sequential quicksort and by the workers.
+void sequential_vs_concurrent(test::RandomGenerator& rand_gen) {
+  cout  << "Performance comparison between sequential quicksort and concurrent quicksort:" << endl;
+
+  concurrent::QuicksortWorkers workers;
+
+  for (int i=0; i<4; i++) {
+    vector<vector<int>> nums_batch1;
+    int nums_in_batch = 0;
+    for (int i=0; i<100; i++) {
+      const int sz = rand_gen.generate_random_number(1, 100000);
+      nums_in_batch += sz;
+      nums_batch1.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+    }
+    vector<vector<int>> nums_batch2(nums_batch1);
+    cout << "Sorting batch #" << i << " with " << nums_in_batch << " numbers in total" << endl;
+
+    auto conc_start = chrono::high_resolution_clock::now();
+    workers.sort_batch(nums_batch1);
+    auto conc_end = chrono::high_resolution_clock::now();
+    auto conc_duration = chrono::duration_cast<chrono::milliseconds>(conc_end - conc_start);
+
+    auto seq_start = chrono::high_resolution_clock::now();
+    sequential::quicksort_sequential_batch(nums_batch2);
+    auto seq_end = chrono::high_resolution_clock::now();
+    auto seq_duration = chrono::duration_cast<chrono::milliseconds>(seq_end - seq_start);
+
+    cout << "Sorting completed by sequential quicksort in " << seq_duration.count() << " ms" << endl;
+    cout << "Sorting completed by concurrent quicksort with " << workers.number_of_workers() << " workers in " << conc_duration.count() << " ms" << endl;
+  }
+
+  workers.kill_workers();
+}
+
+
+// Sorts the same batch with 1..N workers.
+// With a single shared queue adding workers made things slower on many core machines
+// because all of them were fighting for the same lock.
+// With work stealing the time should go down (roughly) linearly until we run out of cores.
+void scaling(test::RandomGenerator& rand_gen) {
+  cout << "Scaling of concurrent quicksort with the number of workers:" << endl;
+  // a few big vectors so that most of the parallelism has to come from splitting, i.e. stealing
+  auto nums_batch = generate_batch(rand_gen, 8, 1'000'000, 1'000'000);
+  const int max_workers = max(1, static_cast<int>(thread::hardware_concurrency()));
+  long long single_worker_ms = 0;
+  for (int n=1; n <= max_workers; n++) {
+    concurrent::QuicksortWorkers workers(n);
+    auto nums_batch_copy = nums_batch;
+    auto duration = time_ms([&](){ workers.sort_batch(nums_batch_copy); });
+    workers.kill_workers();
+    if (n == 1) {
+      single_worker_ms = duration;
+    }
+    cout << n << " workers: " << duration << " ms";
+    if (duration > 0) {
+      cout << " (" << static_cast<double>(single_worker_ms) / duration << "x)";
+    }
+    cout << endl;
+  }
+}
+
+
+// For every idle policy reports
+// - idle cpu cost: cpu time burnt by the pool while there is no batch, in cores (1.0 = one core fully busy)
+// - wake-up latency: median time to sort a tiny batch after the pool has been idle for a while
+void idle_policies() {
+  cout << "Idle cost and wake-up latency of the idle policies:" << endl;
+  const vector<pair<string, concurrent::IdlePolicy>> policies = {
+    {"latency_first", concurrent::IdlePolicy::latency_first()},
+    {"balanced", concurrent::IdlePolicy::balanced()},
+    {"cpu_first", concurrent::IdlePolicy::cpu_first()},
+  };
+  for (auto& [name, policy]: policies) {
+    concurrent::QuicksortWorkers workers(concurrent::default_number_of_workers(), policy);
+
+    // std::clock() measures the cpu time of the whole process, the main thread is sleeping meanwhile
+    const auto idle_wall = chrono::milliseconds(200);
+    const clock_t cpu_start = clock();
+    this_thread::sleep_for(idle_wall);
+    const clock_t cpu_end = clock();
+    const double idle_cores = (static_cast<double>(cpu_end - cpu_start) / CLOCKS_PER_SEC)
+      / chrono::duration<double>(idle_wall).count();
+
+    vector<long long> latencies_us;
+    for (int i=0; i<21; i++) {
+      // long enough for every policy to give up spinning and park
+      this_thread::sleep_for(chrono::milliseconds(20));
+      vector<vector<int>> tiny_batch = {{2, 1}};
+      auto start = chrono::high_resolution_clock::now();
+      workers.sort_batch(tiny_batch);
+      auto end = chrono::high_resolution_clock::now();
+      latencies_us.push_back(chrono::duration_cast<chrono::microseconds>(end - start).count());
+    }
+    workers.kill_workers();
+    sort(latencies_us.begin(), latencies_us.end());
+
+    cout << name << ": idle cpu " << idle_cores << " cores, "
+         << "wake-up latency " << latencies_us[latencies_us.size() / 2] << " us (median)" << endl;
+  }
+}
+
+
+// Sweeps the grain sizes on the same kind of batch as sequential_vs_concurrent().
+// Grain::none() is the behaviour before the cutoffs, every tiny range goes through the queue.
+void grain_sizes(test::RandomGenerator& rand_gen) {
+  cout << "Concurrent quicksort with different grain sizes:" << endl;
+  auto nums_batch = generate_batch(rand_gen, 100, 100000, 1000);
+  vector<concurrent::Grain> grains = {concurrent::Grain::none()};
+  for (int sequential_cutoff: {16, 128, 1024, 8192}) {
+    for (int publish_cutoff: {0, 16384, 131072}) {
+      grains.push_back({ .sequential_cutoff = sequential_cutoff, .publish_cutoff = max(sequential_cutoff, publish_cutoff) });
+    }
+  }
+  for (auto& grain: grains) {
+    concurrent::QuicksortWorkers workers(
+      concurrent::default_number_of_workers(), concurrent::IdlePolicy::balanced(), grain);
+    auto nums_batch_copy = nums_batch;
+    auto duration = time_ms([&](){ workers.sort_batch(nums_batch_copy); });
+    workers.kill_workers();
+    cout << "sequential_cutoff " << setw(5) << grain.sequential_cutoff
+         << ", publish_cutoff " << setw(6) << grain.publish_cutoff
+         << ": " << duration << " ms" << endl;
+  }
+}
+
+
+// One huge vector, the case where batching doesn't help at all.
+// Without the parallel partitioning the first pass runs on a single worker.
+void single_vector(test::RandomGenerator& rand_gen) {
+  const int n = 1 << 24;
+  cout << "Sorting a single vector with " << n << " numbers:" << endl;
+  auto nums = rand_gen.generate_random_vector(n, 0, numeric_limits<int>::max());
+
+  auto nums_copy = nums;
+  cout << "sequential quicksort: " << time_ms([&](){ sequential::quicksort_sequential(0, n - 1, nums_copy); }) << " ms" << endl;
+
+  const int num_workers = concurrent::default_number_of_workers();
+  concurrent::Grain without_parallel_partition;
+  without_parallel_partition.parallel_partition_cutoff = numeric_limits<int>::max();
+  for (auto& [name, grain]: vector<pair<string, concurrent::Grain>>{
+      {"without parallel partition", without_parallel_partition},
+      {"with parallel partition", concurrent::Grain{}}}) {
+    concurrent::QuicksortWorkers workers(num_workers, concurrent::IdlePolicy::balanced(), grain);
+    nums_copy = nums;
+    auto duration = time_ms([&](){ workers.sort(nums_copy); });
+    workers.kill_workers();
+    cout << "concurrent quicksort with " << num_workers << " workers " << name << ": " << duration << " ms" << endl;
+  }
+}
+
+
+// Radix sort against quicksort, sequential and on the workers,
+// on batches like the ones in sequential_vs_concurrent() and on a single big vector,
+// with small numbers (as in the tests) and with the full int range.
+void radix_vs_quicksort(test::RandomGenerator& rand_gen) {
+  cout << "Radix sort vs quicksort:" << endl;
+  concurrent::QuicksortWorkers workers;
+  for (auto [min_val, max_val]: vector<pair<int, int>>{{1, 1000}, {numeric_limits<int>::min(), numeric_limits<int>::max()}}) {
+    vector<pair<string, vector<vector<int>>>> inputs;
+    inputs.push_back({"batch of 100 vectors", {}});
+    for (int i=0; i<100; i++) {
+      const int sz = rand_gen.generate_random_number(1, 100000);
+      inputs.back().second.push_back(rand_gen.generate_random_vector(sz, min_val, max_val));
+    }
+    inputs.push_back({"single vector", {rand_gen.generate_random_vector(1 << 24, min_val, max_val)}});
+
+    for (auto& [name, nums_batch]: inputs) {
+      cout << name << " with numbers in [" << min_val << ", " << max_val << "]:" << endl;
+      auto copy = nums_batch;
+      cout << "  quicksort_sequential_batch: " << time_ms([&](){ sequential::quicksort_sequential_batch(copy); }) << " ms" << endl;
+      copy = nums_batch;
+      cout << "  radix_sort_sequential_batch: " << time_ms([&](){ radix::radix_sort_sequential_batch(copy); }) << " ms" << endl;
+      copy = nums_batch;
+      cout << "  sort_batch (quicksort): " << time_ms([&](){ workers.sort_batch(copy); }) << " ms" << endl;
+      copy = nums_batch;
+      cout << "  sort_batch (radix): " << time_ms([&](){ workers.sort_batch(copy, concurrent::Engine::radix); }) << " ms" << endl;
+    }
+  }
+  workers.kill_workers();
+}
+
+
+// The scalar Dutch flag partition against the AVX2 kernels (the partition and, since they share the switch,
+// the sorting networks at the leaves), in both engines, on random numbers and on numbers with lots of duplicates.
+void partition_kernels(test::RandomGenerator& rand_gen) {
+  cout << "Scalar vs AVX2 partitioning:" << endl;
+  if (!simd::cpu_supports_avx2()) {
+    cout << "skipped, the cpu has no AVX2" << endl;
+    return;
+  }
+  const int n = 1 << 22;
+  concurrent::QuicksortWorkers workers;
+  for (auto [name, max_val]: vector<pair<string, int>>{{"random", numeric_limits<int>::max()}, {"many duplicates", 100}}) {
+    const auto nums = rand_gen.generate_random_vector(n, 0, max_val);
+    cout << n << " " << name << " numbers:" << endl;
+    for (bool avx2: {false, true}) {
+      simd::set_avx2_enabled(avx2);
+      auto copy = nums;
+      auto seq_duration = time_ms([&](){ sequential::quicksort_sequential(0, n - 1, copy); });
+      copy = nums;
+      auto conc_duration = time_ms([&](){ workers.sort(copy); });
+      cout << "  " << (avx2 ? "AVX2  " : "scalar") << ": sequential " << seq_duration
+           << " ms, concurrent " << conc_duration << " ms" << endl;
+    }
+  }
+  simd::set_avx2_enabled(true);
+  workers.kill_workers();
+}
+
+
+// Insertion sort against the sorting networks on leaf sized ranges, for every size class.
+void leaf_sorts(test::RandomGenerator& rand_gen) {
+  cout << "Insertion sort vs sorting networks on small ranges:" << endl;
+  if (!simd::cpu_supports_avx2()) {
+    cout << "skipped, the cpu has no AVX2" << endl;
+    return;
+  }
+  const int total = 1 << 22;
+  for (int size: {8, 16, 32, 64}) {
+    const auto nums = rand_gen.generate_random_vector(total, 0, numeric_limits<int>::max());
+    auto copy = nums;
+    auto insertion_duration = time_ms([&](){
+      for (int start = 0; start + size <= total; start += size) {
+        sequential::insertion_sort(start, start + size - 1, copy);
+      }
+    });
+    copy = nums;
+    auto network_duration = time_ms([&](){
+      for (int start = 0; start + size <= total; start += size) {
+        simd::sort_small_avx2(copy.data() + start, size);
+      }
+    });
+    cout << total / size << " ranges of " << size << " numbers: insertion sort " << insertion_duration
+         << " ms, sorting network " << network_duration << " ms" << endl;
+  }
+}
+
+
+// Generating the next batch while the workers sort the previous one, against doing one after the other.
+void overlapping_batches(test::RandomGenerator& rand_gen) {
+  cout << "Preparing and sorting batches one after the other vs overlapped:" << endl;
+  const int num_batches = 8;
+  concurrent::QuicksortWorkers workers;
+
+  auto one_after_other = time_ms([&](){
+    for (int b=0; b<num_batches; b++) {
+      auto nums_batch = generate_batch(rand_gen, 100, 100000, 1000);
+      workers.sort_batch(nums_batch);
+    }
+  });
+
+  auto overlapped = time_ms([&](){
+    vector<vector<int>> in_flight;
+    future<void> in_flight_sorted;
+    for (int b=0; b<num_batches; b++) {
+      auto nums_batch = generate_batch(rand_gen, 100, 100000, 1000);
+      if (in_flight_sorted.valid()) {
+        in_flight_sorted.get();
+      }
+      in_flight = move(nums_batch);
+      in_flight_sorted = workers.submit_batch(in_flight);
+    }
+    in_flight_sorted.get();
+  });
+  workers.kill_workers();
+
+  cout << "one after the other: " << one_after_other << " ms" << endl;
+  cout << "overlapped: " << overlapped << " ms" << endl;
+}
+
+
+// Merging a sorted batch into one vector, single threaded against on the workers (in one piece and streamed).
+void merging(test::RandomGenerator& rand_gen) {
+  cout << "Merging a sorted batch into one sorted vector:" << endl;
+  concurrent::QuicksortWorkers workers;
+  auto runs = generate_batch(rand_gen, 100, 200000, 1000000);
+  workers.sort_batch(runs);
+  size_t total = 0;
+  for (auto& run: runs) {
+    total += run.size();
+  }
+  cout << runs.size() << " runs with " << total << " numbers in total" << endl;
+
+  vector<int> merged;
+  cout << "merge_sequential: " << time_ms([&](){ merge::merge_sequential(runs, merged); }) << " ms" << endl;
+  cout << "merge_batch with " << workers.number_of_workers() << " workers: "
+       << time_ms([&](){ workers.merge_batch(runs, merged); }) << " ms" << endl;
+  long long checksum = 0;
+  cout << "merge_batch_chunked (1M numbers per chunk): " << time_ms([&](){
+    workers.merge_batch_chunked(runs, 1 << 20, [&](const int* nums, size_t count) {
+      checksum += nums[count - 1];
+    });
+  }) << " ms" << endl;
+  workers.kill_workers();
+}
+
+
+// Sorts a file of n random ints (1 << 29 is 2GB) in the temp directory with external::sort_file() and checks the result.
+// The defaults keep ~550MB in memory (two runs of 256MB plus the buffers).
+void external_sort(const size_t n) {
+  const filesystem::path dir = filesystem::temp_directory_path();
+  if (filesystem::space(dir).available < 3 * n * sizeof(int)) {
+    cout << "External sort skipped, not enough space in " << dir << endl;
+    return;
+  }
+  const string input_path = (dir / "external_sort_input.bin").string();
+  const string output_path = (dir / "external_sort_output.bin").string();
+  cout << "External sort of " << (n * sizeof(int) >> 20) << "MB:" << endl;
+  long long checksum = 0;
+  {
+    ofstream file(input_path, ios::binary | ios::trunc);
+    minstd_rand rand_eng(42);
+    vector<int> block(1 << 20);
+    for (size_t written = 0; written < n; written += block.size()) {
+      block.resize(min(block.size(), n - written));
+      for (int& num: block) {
+        num = static_cast<int>(rand_eng());
+        checksum += num;
+      }
+      file.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(int));
+    }
+  }
+
+  concurrent::QuicksortWorkers workers;
+  auto duration = time_ms([&](){ external::sort_file(workers, input_path, output_path); });
+  workers.kill_workers();
+
+  // stream the output back, it must be sorted and hold the same numbers
+  bool sorted = filesystem::file_size(output_path) == n * sizeof(int);
+  {
+    ifstream file(output_path, ios::binary);
+    vector<int> block(1 << 20);
+    int previous = numeric_limits<int>::min();
+    for (size_t read = 0; sorted && read < n; read += block.size()) {
+      block.resize(min(block.size(), n - read));
+      file.read(reinterpret_cast<char*>(block.data()), block.size() * sizeof(int));
+      for (int num: block) {
+        sorted = sorted && previous <= num;
+        previous = num;
+        checksum -= num;
+      }
+    }
+  }
+  filesystem::remove(input_path);
+  filesystem::remove(output_path);
+  cout << "sort_file: " << duration << " ms (" << (n * sizeof(int) >> 20) * 1000 / max(1LL, duration) << " MB/s), "
+       << (sorted && checksum == 0 ? "sorted" : "NOT SORTED") << endl;
+}
+
+
+template<typename T, typename Compare, typename Projection, typename Generator>
+void time_element_type(const string& name, int n, Compare comp, Projection proj, Generator generate) {
+  test::RandomGenerator rand_gen;
+  vector<T> nums;
+  for (int i=0; i<n; i++) {
+    nums.push_back(generate(rand_gen));
+  }
+  auto copy = nums;
+  auto seq_duration = time_ms([&](){ sequential::quicksort_sequential(0, n - 1, copy, comp, proj); });
+  concurrent::QuicksortWorkers<T, Compare, Projection> workers(
+    concurrent::default_number_of_workers(), concurrent::IdlePolicy::balanced(), concurrent::Grain{}, comp, proj);
+  copy = nums;
+  auto conc_duration = time_ms([&](){ workers.sort(copy); });
+  workers.kill_workers();
+  cout << name << ": sequential " << seq_duration << " ms, concurrent " << conc_duration << " ms" << endl;
+}
+
+struct KeyedRecord {
+  int64_t key;
+  int64_t payload[3];
+};
+
+// The same number of elements of different types.
+// The int version should take as long as before the engines became templates.
+void element_types() {
+  const int n = 1 << 22;
+  cout << "Sorting " << n << " elements of different types:" << endl;
+  time_element_type<int>("int", n, less<>(), identity(), [](test::RandomGenerator& rand_gen) {
+    return rand_gen.generate_random_number(0, numeric_limits<int>::max());
+  });
+  time_element_type<int64_t>("int64_t", n, less<>(), identity(), [](test::RandomGenerator& rand_gen) {
+    return static_cast<int64_t>(rand_gen.generate_random_number(0, numeric_limits<int>::max())) << 20;
+  });
+  time_element_type<float>("float", n, less<>(), identity(), [](test::RandomGenerator& rand_gen) {
+    return static_cast<float>(rand_gen.generate_random_number(0, numeric_limits<int>::max()));
+  });
+  time_element_type<KeyedRecord>("32 byte struct by key", n, less<>(), &KeyedRecord::key, [](test::RandomGenerator& rand_gen) {
+    return KeyedRecord{ .key = rand_gen.generate_random_number(0, numeric_limits<int>::max()), .payload = {} };
+  });
+}
+
+
+// Sorts a batch whose vectors were first touched on different nodes, with and without NUMA placement.
+// On a multi socket host every node fills its share of the vectors from a thread pinned to it.
+// On a single node host the topology is simulated, that shows the scheduling (cross node steals)
+// but of course not the time saved by not reading remote memory.
+void numa_placement(test::RandomGenerator& rand_gen) {
+  topology::Topology topology = topology::Topology::detect();
+  const bool simulated = topology.number_of_nodes() < 2;
+  if (simulated) {
+    topology = topology::Topology::simulated(2);
+  }
+  cout << "Sorting with and without NUMA placement on " << topology.number_of_nodes()
+       << (simulated ? " simulated" : "") << " nodes:" << endl;
+  const auto source = generate_batch(rand_gen, 64, 500000, 1000000);
+
+  for (bool numa_aware: {false, true}) {
+    // vector i is first touched on node i % number_of_nodes
+    vector<vector<int>> nums_batch(source.size());
+    vector<thread> fillers;
+    for (int node = 0; node < topology.number_of_nodes(); node++) {
+      fillers.push_back(thread([&, node](){
+        if (!simulated) {
+          topology::pin_current_thread(topology.node_cpus[node]);
+        }
+        for (size_t i = node; i < source.size(); i += topology.number_of_nodes()) {
+          nums_batch[i] = source[i];
+        }
+      }));
+    }
+    for (auto& t: fillers) {
+      t.join();
+    }
+    concurrent::QuicksortWorkers workers(concurrent::Config{ .numa_aware = numa_aware, .topology = topology });
+    auto duration = time_ms([&](){ workers.sort_batch(nums_batch); });
+    const long long cross_node_steals = workers.cross_node_steals();
+    workers.kill_workers();
+    cout << (numa_aware ? "NUMA aware: " : "not NUMA aware: ") << duration << " ms";
+    if (numa_aware) {
+      cout << ", " << cross_node_steals << " tasks stolen across nodes";
+    }
+    cout << endl;
+  }
+}
+
+
+void selection(test::RandomGenerator& rand_gen) {
+  cout << "Full sort vs partial sort / nth element / top k of a batch of 100 vectors of 100000 numbers:" << endl;
+  concurrent::QuicksortWorkers workers;
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<100; i++) {
+    nums_batch.push_back(rand_gen.generate_random_vector(100000, numeric_limits<int>::min(), numeric_limits<int>::max()));
+  }
+  auto copy = nums_batch;
+  cout << "  sort_batch: " << time_ms([&](){ workers.sort_batch(copy); }) << " ms" << endl;
+  for (int k: {10, 1000, 10000}) {
+    copy = nums_batch;
+    cout << "  partial_sort_batch k=" << k << ": " << time_ms([&](){ workers.partial_sort_batch(copy, k); }) << " ms" << endl;
+  }
+  copy = nums_batch;
+  cout << "  nth_element_batch (median): " << time_ms([&](){ workers.nth_element_batch(copy, 50000); }) << " ms" << endl;
+  copy = nums_batch;
+  cout << "  top_k k=100 over all the vectors: " << time_ms([&](){ workers.top_k(copy, 100); }) << " ms" << endl;
+  workers.kill_workers();
+}
+
+// How long it takes from cancel() until the workers are done with a big batch
+void cancellation(test::RandomGenerator& rand_gen) {
+  cout << "Cancelling a batch of 1000 vectors halfway:" << endl;
+  concurrent::QuicksortWorkers workers;
+  auto nums_batch = generate_batch(rand_gen, 1000, 100000, 1000000);
+  for (int delay_ms: {1, 10, 100}) {
+    auto copy = nums_batch;
+    concurrent::CancellationToken token;
+    auto outcome_future = workers.submit_batch(copy, token);
+    this_thread::sleep_for(chrono::milliseconds(delay_ms));
+    concurrent::BatchOutcome outcome;
+    const long long drain_ms = time_ms([&](){
+      token.cancel();
+      outcome = outcome_future.get();
+    });
+    cout << "  cancelled after " << delay_ms << " ms: " << count(outcome.completed.begin(), outcome.completed.end(), true)
+         << " vectors sorted, the workers were free " << drain_ms << " ms after cancel()" << endl;
+  }
+  auto copy = nums_batch;
+  auto outcome = workers.sort_batch(copy, concurrent::CancellationToken(),
+                                    chrono::steady_clock::now() + chrono::milliseconds(50));
+  cout << "  with a deadline in 50 ms: " << count(outcome.completed.begin(), outcome.completed.end(), true)
+       << " vectors sorted" << endl;
+  workers.kill_workers();
+}
+
+// Latency of small batches submitted right behind a big one.
+// Plain submits queue behind the whole big batch, clients take turns, a high priority client goes first.
+void mixed_workload(test::RandomGenerator& rand_gen) {
+  cout << "Small batches (10 x 1000 numbers) submitted right after a big one (40 x 50000 numbers):" << endl;
+  auto big_batch = generate_batch(rand_gen, 40, 50000, 1000000);
+  auto small_batch = generate_batch(rand_gen, 10, 1000, 1000000);
+  for (const string setup: {"plain submits", "equal clients", "high priority client"}) {
+    concurrent::QuicksortWorkers workers;
+    const int big_client = workers.add_client();
+    const int small_client = workers.add_client(setup == "high priority client" ? concurrent::Priority::high
+                                                                                : concurrent::Priority::normal);
+    vector<double> latencies_ms;
+    for (int i=0; i < 100; i++) {
+      auto big_copy = big_batch;
+      auto small_copy = small_batch;
+      future<void> big_future;
+      const auto start = chrono::steady_clock::now();
+      if (setup == "plain submits") {
+        big_future = workers.submit_batch(big_copy);
+        workers.sort_batch(small_copy);
+      } else {
+        big_future = workers.submit_batch_as(big_client, big_copy);
+        workers.sort_batch_as(small_client, small_copy);
+      }
+      latencies_ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+      big_future.get();
+    }
+    workers.kill_workers();
+    sort(latencies_ms.begin(), latencies_ms.end());
+    printf("  %-22s p50 %8.3f ms, p99 %8.3f ms\n", (setup + ":").c_str(),
+           latencies_ms[latencies_ms.size() / 2], latencies_ms[latencies_ms.size() * 99 / 100]);
+  }
+}
+
+// Sorting fat records by their key vs sorting the keys and carrying the rest along in its own array
+void key_value_sorts(test::RandomGenerator& rand_gen) {
+  struct FatRecord {
+    int key;
+    char rest[60];
+  };
+  const int n = 1 << 22;
+  cout << "Sorting " << n << " records of " << sizeof(FatRecord) << " bytes by their int key:" << endl;
+  vector<int> keys = rand_gen.generate_random_vector(n, numeric_limits<int>::min(), numeric_limits<int>::max());
+  vector<FatRecord> records(n);
+  vector<array<char, 60>> payloads(n);
+  for (int i=0; i < n; i++) {
+    records[i].key = keys[i];
+  }
+
+  auto records_copy = records;
+  cout << "  quicksort_sequential of the records: " << time_ms([&](){
+    sequential::quicksort_sequential(0, n - 1, records_copy, less<>(), &FatRecord::key);
+  }) << " ms" << endl;
+  auto keys_copy = keys;
+  cout << "  sort_by_key, keys and 60 byte payloads: " << time_ms([&](){
+    key_value::sort_by_key(keys_copy, payloads);
+  }) << " ms" << endl;
+  cout << "  argsort: " << time_ms([&](){ key_value::argsort(keys); }) << " ms" << endl;
+  keys_copy = keys;
+  vector<uint32_t> indices(n);
+  cout << "  argsort + gathering the records: " << time_ms([&](){
+    indices = key_value::argsort(keys);
+    for (int i=0; i < n; i++) {
+      records_copy[i] = records[indices[i]];
+    }
+  }) << " ms" << endl;
+}
+
+// Inputs which are quadratic for a quicksort with the middle number as the pivot, next to random ones
+void quadratic_killers() {
+  cout << "Structured and adversarial inputs, 1M numbers:" << endl;
+  concurrent::QuicksortWorkers workers;
+  for (const string& distribution: distributions::ALL) {
+    const vector<int> input = distributions::generate(distribution, 1 << 20);
+    auto nums = input;
+    const long long sequential_ms = time_ms([&](){ sequential::quicksort_sequential(0, nums.size() - 1, nums); });
+    nums = input;
+    const long long concurrent_ms = time_ms([&](){ workers.sort(nums); });
+    nums = input;
+    const long long std_ms = time_ms([&](){ std::sort(nums.begin(), nums.end()); });
+    cout << "  " << distribution << ": quicksort_sequential " << sequential_ms << " ms, sort " << concurrent_ms
+         << " ms, std::sort " << std_ms << " ms" << endl;
+  }
+  workers.kill_workers();
+}
+
+// Where the time of a batch went, per worker
+void worker_stats(test::RandomGenerator& rand_gen) {
+  cout << "Per worker stats of one batch:" << endl;
+  if constexpr (!stats::ENABLED) {
+    cout << "compiled with QUICKSORT_WORKERS_STATS=0" << endl;
+    return;
+  }
+  concurrent::QuicksortWorkers workers;
+  auto nums_batch = generate_batch(rand_gen, 100, 100000, 1000);
+  workers.sort_batch(nums_batch);
+  const stats::Stats snapshot = workers.stats();
+  workers.kill_workers();
+  cout << "worker  tasks  helpers  partitioned  busy ms  spin ms  parked ms  lock waits  lock wait ms  steals  max queue" << endl;
+  auto print_row = [](const string& name, const stats::WorkerStats& w) {
+    printf("%-7s %-6llu %-8llu %-12llu %-8.2f %-8.2f %-10.2f %-11llu %-13.3f %-7llu %llu\n", name.c_str(),
+           (unsigned long long) w.tasks_executed, (unsigned long long) w.helper_tasks,
+           (unsigned long long) w.elements_partitioned, w.busy_ns / 1e6, w.spin_ns / 1e6, w.parked_ns / 1e6,
+           (unsigned long long) w.lock_contentions, w.lock_wait_ns / 1e6, (unsigned long long) w.steals,
+           (unsigned long long) w.queue_high_water);
+  };
+  for (size_t i=0; i < snapshot.workers.size(); i++) {
+    print_row(to_string(i), snapshot.workers[i]);
+  }
+  print_row("total", snapshot.total());
+}
+
+}
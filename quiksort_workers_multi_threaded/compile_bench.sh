@@ -0,0 +1,5 @@
+#!/bin/sh
+
+# the benchmark suite, optimized and without sanitizers
+mkdir -p build
+clang++ -std=c++20 -Wall -O3 -march=native -DNDEBUG bench.cpp -o build/bench
@@ -2,26 +2,138 @@
 
 #include <iostream>
 #include <vector>
-#include <queue>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
+#include <future>
 #include <memory>
 #include <atomic>
 #include <cassert>
 #include <stdexcept>
 #include <optional>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <cstring>
+#include <type_traits>
+#include <span>
+#include "sequential.hpp"
+#include "radix.hpp"
+#include "topology.hpp"
+#include "merge.hpp"
+#include "stats.hpp"
+#include "key_value.hpp"
 
 namespace concurrent {
 
 using namespace std;
 
 
+struct ParallelJob;
+
+// Which algorithm a batch gets sorted with
+enum class Engine {
+  quicksort,
+  // LSD radix sort, no comparisons at all, the better choice for big vectors of ints.
+  // Needs a temporary vector as big as the one being sorted.
+  radix
+};
+
+// How much of every vector of a batch gets sorted
+enum class Selection {
+  // all of it
+  all,
+  // only the first Batch::rank numbers, see QuicksortWorkers::partial_sort_batch()
+  first,
+  // only position Batch::rank, see QuicksortWorkers::nth_element_batch()
+  nth
+};
+
+// Scheduling classes of the clients, see QuicksortWorkers::add_client().
+// A worker starts the vectors of a higher class first, for the high class it even leaves its own queue for later.
+enum class Priority {
+  high,
+  normal,
+  low
+};
+
+constexpr int NUM_PRIORITIES = 3;
+
+// Shared by the caller and every batch it was submitted with, cancel() drops what is left of all of them.
+// Copies share the same flag.
+class CancellationToken {
+public:
+  CancellationToken(): cancelled(make_shared<atomic<bool>>(false)) {}
+
+  void cancel() {
+    *cancelled = true;
+  }
+
+  bool is_cancelled() const {
+    return *cancelled;
+  }
+
+private:
+  shared_ptr<atomic<bool>> cancelled;
+};
+
+// What came of a batch submitted with a cancellation token or a deadline
+struct BatchOutcome {
+  // completed[i] if vector i got sorted completely.
+  // The others were dropped before or while being sorted, they hold the same numbers in no particular order.
+  vector<bool> completed;
+
+  bool all_completed() const {
+    return all_of(completed.begin(), completed.end(), [](bool c) { return c; });
+  }
+};
+
+// The extra bookkeeping of a batch which may be dropped halfway, see QuicksortWorkers::submit_batch()
+struct Cancellable {
+  CancellationToken token;
+  chrono::steady_clock::time_point deadline;
+  // set by the first worker which notices, so the tasks left over are dropped without looking at the clock
+  atomic<bool> dropped = false;
+  // per vector, whether any of its tasks got dropped
+  unique_ptr<atomic<bool>[]> vector_dropped;
+  promise<BatchOutcome> outcome;
+};
+
+// Bookkeeping of one submitted batch.
+// Every batch counts its own tasks, so any number of them can be in flight at the same time.
+// This (and the promise's shared state) is the only thing allocated per batch,
+// the tasks themselves are plain values living in the queues.
+struct Batch {
+  // tasks which are queued or being worked on, the batch is done when it drops to 0
+  atomic<int> in_progress_tasks;
+  Engine engine;
+  Selection selection;
+  int rank;
+  int num_vectors;
+  promise<void> completed;
+  // only for batches which can be cancelled or have a deadline
+  unique_ptr<Cancellable> cancellable;
+  // for the batch timelines, see QuicksortWorkers::start_tracing()
+  uint64_t id;
+  uint64_t submitted_ns;
+};
+
+// 40 bytes, copied by value into the preallocated ring of a queue, no allocation per task.
+template<typename T>
 struct Task {
   int start_index;
   int end_index;
-  vector<int>& nums;
-  bool poison;
+  // see sequential::bad_partition_budget(), carried along so that a range can't escape it by being stolen
+  int bad_partitions_left;
+  // which vector of the batch the range belongs to
+  int vector_index;
+  // a pointer instead of a reference so that tasks can be copied and assigned freely
+  vector<T>* nums;
+  Batch* batch;
+  // only set for the helper tasks of parallel_for(), these don't sort a range of their own
+  ParallelJob* job;
 };
 
 struct PivotResult {
@@ -31,140 +143,1288 @@ struct PivotResult {
 };
 
 
-PivotResult arrange_around_pivot(const int start, const int end, vector<int>& nums);
+using sequential::swap;
+using sequential::KeyOf;
+
+template<typename T, typename Compare = less<>, typename Projection = identity>
+PivotResult arrange_around_pivot(const int start, const int end, vector<T>& nums, Compare comp = {}, Projection proj = {});
 
+
+// A loop whose iterations (chunks) are shared by everybody who joins in.
+// Chunks are claimed one by one from next_chunk, so a helper that shows up late simply finds nothing left to do.
+// See QuicksortWorkers::parallel_for()
+struct ParallelJob {
+  // the loop body is whatever lambda the caller has on its stack, called through a plain function pointer.
+  // A std::function would have to allocate for lambdas capturing more than a couple of references.
+  const void* body;
+  void (*call_body)(const void* body, int chunk);
+  const int num_chunks;
+  atomic<int> next_chunk = 0;
+  // helper tasks which haven't finished yet, the job must outlive all of them
+  atomic<int> pending_helpers = 0;
+
+  void run_chunks() {
+    for (int chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++) {
+      call_body(body, chunk);
+    }
+  }
+};
+
+
+// Each worker owns one of these queues.
+// The owner pushes and pops from the front (LIFO) so it keeps working on the
+// most recently split range which is likely still hot in its cache.
+// Other workers steal from the back (FIFO) which hands them the oldest i.e. largest ranges,
+// so a single steal moves a big chunk of work and thieves don't come back too often.
+//
+// Every queue has its own mutex, so workers only contend when they steal from the same victim
+// instead of all of them fighting over one global queue.
+//
+// The tasks live in a ring buffer allocated up front. A std::deque allocates and frees its blocks
+// as it grows and shrinks, i.e. all the time while a batch is being split.
+// The ring only doubles when it is completely full, which after warming up doesn't happen anymore.
+template<typename T>
+class WorkStealingQueue {
+public:
+  static constexpr size_t INITIAL_CAPACITY = 1024;
+
+  WorkStealingQueue(): ring(INITIAL_CAPACITY) {}
+  WorkStealingQueue(const WorkStealingQueue&) = delete;
+  WorkStealingQueue& operator=(const WorkStealingQueue&) = delete;
+
+  void push(Task<T> task) {
+    auto lk = lock();
+    if (size == ring.size()) {
+      grow();
+    }
+    front = (front - 1) & (ring.size() - 1);
+    ring[front] = task;
+    size++;
+    high_water.raise_to(size);
+  }
+
+  optional<Task<T>> try_pop() {
+    auto lk = lock();
+    if (size == 0) {
+      return nullopt;
+    }
+    return pop_front();
+  }
+
+  // Takes the helper tasks of the job out of the queue wherever they are, the others keep their order.
+  // Returns how many there were.
+  int remove_helpers(const ParallelJob* job) {
+    auto lk = lock();
+    size_t kept = 0;
+    for (size_t i=0; i < size; i++) {
+      const Task<T>& task = ring[(front + i) & (ring.size() - 1)];
+      if (task.job != job) {
+        ring[(front + kept) & (ring.size() - 1)] = task;
+        kept++;
+      }
+    }
+    const int removed = size - kept;
+    size = kept;
+    return removed;
+  }
+
+  optional<Task<T>> try_steal() {
+    auto lk = lock();
+    if (size == 0) {
+      return nullopt;
+    }
+    size--;
+    return ring[(front + size) & (ring.size() - 1)];
+  }
+
+  // the most tasks the queue ever held
+  uint64_t queue_high_water() const {
+    return high_water.get();
+  }
+
+private:
+  // the capacity is always a power of 2 so that wrapping around is a mask instead of a division
+  vector<Task<T>> ring;
+  size_t front = 0;
+  size_t size = 0;
+  mutex mtx;
+  // only written with mtx held
+  stats::Counter high_water;
+
+  // Locks mtx. With stats on, a worker which has to wait for it gets the wait charged to its counters,
+  // the try_lock() costs the same as the lock() when the mutex is free.
+  unique_lock<mutex> lock() {
+    if constexpr (stats::ENABLED) {
+      unique_lock lk(mtx, try_to_lock);
+      if (!lk.owns_lock()) {
+        const uint64_t wait_start = stats::now_ns();
+        lk.lock();
+        if (stats::current_worker != nullptr) {
+          stats::current_worker->lock_contentions.add(1);
+          stats::current_worker->lock_wait_ns.add(stats::now_ns() - wait_start);
+        }
+      }
+      return lk;
+    } else {
+      return unique_lock(mtx);
+    }
+  }
+
+  Task<T> pop_front() {
+    Task<T> task = ring[front];
+    front = (front + 1) & (ring.size() - 1);
+    size--;
+    return task;
+  }
+
+  void grow() {
+    vector<Task<T>> bigger(ring.size() * 2);
+    for (size_t i=0; i < size; i++) {
+      bigger[i] = ring[(front + i) & (ring.size() - 1)];
+    }
+    ring.swap(bigger);
+    front = 0;
+  }
+};
+
+
+// What an idle worker does when it can't find any task.
+// It first keeps looking (yielding in between) for spin_duration, which keeps the wake-up latency low
+// as long as new work shows up soon, e.g. while a batch is being split.
+// After that it parks i.e. sleeps in the kernel and doesn't burn the cpu until somebody pushes work.
+struct IdlePolicy {
+  chrono::microseconds spin_duration;
+
+  // only park after a long pause between batches, workers react immediately but idle workers keep burning their cores
+  static IdlePolicy latency_first() {
+    return { .spin_duration = chrono::seconds(1) };
+  }
+  static IdlePolicy balanced() {
+    return { .spin_duration = chrono::microseconds(100) };
+  }
+  // park as soon as there is nothing to do, the first task after a pause pays the wake-up cost
+  static IdlePolicy cpu_first() {
+    return { .spin_duration = chrono::microseconds(0) };
+  }
+};
+
+
+// How small a range has to get before the workers stop treating it as a separate task.
+// Ranges with at most sequential_cutoff numbers are sorted in place with sequential::quicksort_sequential
+// (which itself switches to insertion sort for the tiniest ranges).
+// Ranges with at most publish_cutoff numbers are still split, but the worker keeps them on its private stack
+// instead of pushing them to its queue, so there is no locking and no Batch::in_progress_tasks churn for them.
+// Only the bigger ranges are worth publishing for other workers to steal.
+// Ranges with more than parallel_partition_cutoff numbers are partitioned (or radix sorted) by all the workers together,
+// otherwise the first pass over one huge vector would run on one thread while everybody else is idle.
+struct Grain {
+  int sequential_cutoff = 1024;
+  int publish_cutoff = 16384;
+  int parallel_partition_cutoff = 1 << 20;
+
+  // every partition down to 2 numbers becomes a published task (the behaviour before the cutoffs)
+  static Grain none() {
+    return { .sequential_cutoff = 1, .publish_cutoff = 0, .parallel_partition_cutoff = numeric_limits<int>::max() };
+  }
+};
+
+
+int default_number_of_workers() {
+  // One core is left for the thread submitting the batches.
+  // hardware_concurrency() is allowed to return 0 and counts cpus we may not be allowed to use
+  // (taskset, cpusets) or only get a fraction of (cgroup cpu quota in a container), so ask the os instead.
+  // Keep at least one worker so that a batch can always make progress.
+  return max(1, topology::usable_cpus() - 1);
+}
+
+
+// Everything that can be set when the workers are started.
+struct Config {
+  // 0 picks default_number_of_workers()
+  int num_workers = 0;
+  // worker i is pinned to cpus[i % cpus.size()], empty leaves the placement to the os
+  vector<int> cpus;
+  // Pin the workers node by node and queue every vector for the workers of the node whose memory holds it
+  // (the node of the thread which first touched it). Thieves look on their own node before crossing over,
+  // so a vector is mostly sorted by the cores next to its memory instead of dragging it over the interconnect.
+  bool numa_aware = false;
+  // only used when numa_aware, topology::Topology::detect() if not given
+  optional<topology::Topology> topology;
+  IdlePolicy idle_policy = IdlePolicy::balanced();
+  Grain grain;
+};
+
+
+// Sorts vectors of T by comp(proj(a), proj(b)), see sequential::KeyOf.
+// QuicksortWorkers<> is the original int version.
+template<typename T = int, typename Compare = less<>, typename Projection = identity>
 class QuicksortWorkers {
 public:
+  // the radix engine works on the bits of the numbers, it only knows how to order plain ints
+  static constexpr bool radix_supported =
+    is_same_v<T, int> && (is_same_v<Compare, less<>> || is_same_v<Compare, less<int>>) && is_same_v<Projection, identity>;
+
+  QuicksortWorkers(): QuicksortWorkers(Config{}) {}
 
-  QuicksortWorkers() {
-    for (int i=0; i < thread::hardware_concurrency() - 1; i++) {
-      workers.push_back(thread([this](){
-        worker();
+  explicit QuicksortWorkers(int num_workers, IdlePolicy idle_policy = IdlePolicy::balanced(), Grain grain = Grain{},
+                            Compare comp = {}, Projection proj = {})
+    : QuicksortWorkers(Config{ .num_workers = num_workers, .idle_policy = idle_policy, .grain = grain }, comp, proj) {
+    assert(num_workers > 0);
+  }
+
+  explicit QuicksortWorkers(Config config, Compare comp = {}, Projection proj = {})
+    : idle_policy(config.idle_policy), grain(config.grain), comp(comp), proj(proj) {
+    const int num_workers = config.num_workers > 0 ? config.num_workers : default_number_of_workers();
+    place_workers(num_workers, config);
+    if (numa_aware) {
+      for (size_t node=0; node < node_workers.size(); node++) {
+        node_inboxes.push_back(make_unique<WorkStealingQueue<T>>());
+      }
+    }
+    // the client of everybody who doesn't add their own
+    add_client();
+    for (int i=0; i < num_workers; i++) {
+      task_queues.push_back(make_unique<WorkStealingQueue<T>>());
+      worker_counters.push_back(make_unique<stats::WorkerCounters>());
+      worker_traces.push_back(make_unique<stats::TraceBuffer>());
+    }
+    for (int i=0; i < num_workers; i++) {
+      workers.push_back(thread([this, i](){
+        worker(i);
       }));
     }
   }
 
   int number_of_workers() {
-    return workers.size();
+    // not workers.size(), the workers already call this while the constructor is still filling the vector
+    return task_queues.size();
   }
 
-  void kill_workers() {
-    {
-      lock_guard lk(task_q_mtx);
-      for (size_t i=0; i < workers.size(); i++) {
-        task_q.push({
-          .start_index = -1,
-          .end_index = -1,
-          .nums = *(new vector<int>()),
-          .poison = true
-        });
+  // the NUMA node worker i is scheduled as, always 0 unless Config::numa_aware
+  int node_of_worker(int worker_index) {
+    return worker_node[worker_index];
+  }
+
+  // how many tasks were stolen by a worker on another node than the victim's, see Config::numa_aware
+  long long cross_node_steals() {
+    return cross_node_steals_count;
+  }
+
+  // A snapshot of the counters of every worker, all 0 when compiled with QUICKSORT_WORKERS_STATS=0.
+  // Can be taken at any time, while sorting the counters of different workers are a few ns apart.
+  stats::Stats stats() {
+    stats::Stats snapshot;
+    for (int i=0; i < number_of_workers(); i++) {
+      snapshot.workers.push_back(stats::WorkerStats::of(*worker_counters[i], task_queues[i]->queue_high_water()));
+    }
+    return snapshot;
+  }
+
+  // Records every task the workers run and every batch from submit to completion, until stop_tracing().
+  // Drops what was recorded before. Costs a clock read and a push_back per task while on, nothing while off.
+  void start_tracing() {
+    if constexpr (stats::ENABLED) {
+      for (auto& trace: worker_traces) {
+        lock_guard lk(trace->mtx);
+        trace->events.clear();
       }
+      {
+        lock_guard lk(batch_trace.mtx);
+        batch_trace.events.clear();
+      }
+      trace_origin_ns = stats::now_ns();
+      tracing = true;
     }
+  }
+
+  void stop_tracing() {
+    tracing = false;
+  }
+
+  // Writes what was recorded as a Chrome trace (chrome://tracing, ui.perfetto.dev)
+  void write_chrome_trace(const string& path) {
+    stats::write_chrome_trace(path, worker_traces, batch_trace, trace_origin_ns);
+  }
+
+  void kill_workers() {
+    done = true;
+    wake_parked_workers(true);
     // wait until all workers are killed
     for (auto& t: workers) {
       t.join();
     } 
   }
 
-  void sort_batch(vector<vector<int>>& nums_batch) {
-    {
-      lock_guard lk(batch_mtx);
-      if (in_progress_tasks > 0) {
-        throw runtime_error("Exsiting batch hasn't finished");
-      }
+  // Adds a submitter with a queue of its own and returns its id for submit_batch_as().
+  // The vectors of its batches wait in that queue until a worker starts them. The workers take turns
+  // between the clients of a class, weight vectors from one client before moving on to the next (weighted round robin),
+  // so a client with a huge batch can't starve one with small batches: they wait for a turn, not for the huge batch.
+  // Everything submitted without a client goes through client 0 (normal, weight 1).
+  int add_client(Priority priority = Priority::normal, int weight = 1) {
+    assert(weight > 0);
+    lock_guard lk(clients_mtx);
+    const int id = clients.size();
+    clients.push_back(make_unique<Client>(priority, weight));
+    clients_by_priority[static_cast<int>(priority)].push_back(id);
+    return id;
+  }
+
+  future<void> submit_batch_as(const int client, vector<vector<T>>& nums_batch, Engine engine = Engine::quicksort) {
+    return submit_selection(nums_batch, engine, Selection::all, 0, nullptr, client);
+  }
+
+  void sort_batch_as(const int client, vector<vector<T>>& nums_batch, Engine engine = Engine::quicksort) {
+    submit_batch_as(client, nums_batch, engine).get();
+  }
+
+  // Queues the batch and returns right away, the future becomes ready once every vector is sorted.
+  // nums_batch must stay alive and untouched until then.
+  // Any number of batches (from any number of threads) can be in flight at the same time.
+  future<void> submit_batch(vector<vector<T>>& nums_batch, Engine engine = Engine::quicksort) {
+    return submit_selection(nums_batch, engine, Selection::all, 0);
+  }
+
+  future<void> submit(vector<T>& nums, Engine engine = Engine::quicksort) {
+    check_engine(engine);
+    // the batch only holds references to the vectors, so a batch of one can be built on the fly
+    Batch* batch = new Batch();
+    batch->in_progress_tasks = 1;
+    batch->num_vectors = 1;
+    batch->engine = engine;
+    stamp(batch);
+    future<void> completed = batch->completed.get_future();
+    push_root({
+      .start_index = 0,
+      .end_index = static_cast<int>(nums.size() - 1),
+      .bad_partitions_left = sequential::bad_partition_budget(nums.size()),
+      .vector_index = 0,
+      .nums = &nums,
+      .batch = batch,
+      .job = nullptr
+    }, default_client(), next_queue++);
+    wake_parked_workers(true);
+    return completed;
+  }
+
+  void sort_batch(vector<vector<T>>& nums_batch, Engine engine = Engine::quicksort) {
+    submit_batch(nums_batch, engine).get();
+  }
+
+  // Like submit_batch(), but whatever is left of the batch is dropped once token gets cancelled or the deadline passes.
+  // The workers check before every task and every range they split off, tasks of a dropped batch still in the queues
+  // are popped and thrown away without touching their vector. The outcome tells which vectors got sorted completely.
+  future<BatchOutcome> submit_batch(vector<vector<T>>& nums_batch, const CancellationToken& token,
+                                    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max(),
+                                    Engine engine = Engine::quicksort) {
+    auto cancellable = make_unique<Cancellable>();
+    cancellable->token = token;
+    cancellable->deadline = deadline;
+    cancellable->vector_dropped = make_unique<atomic<bool>[]>(nums_batch.size());
+    future<BatchOutcome> outcome = cancellable->outcome.get_future();
+    if (nums_batch.empty()) {
+      cancellable->outcome.set_value({});
+      return outcome;
     }
-    {
-      lock_guard lk(task_q_mtx);
-      assert(task_q.empty());
-      in_progress_tasks = nums_batch.size();
-      for (vector<int>& nums: nums_batch) {
-        task_q.push({
-          .start_index = 0,
-          .end_index = static_cast<int>(nums.size() - 1),
-          .nums = nums,
-          .poison = false
-        });
-      }  
+    submit_selection(nums_batch, engine, Selection::all, 0, move(cancellable));
+    return outcome;
+  }
+
+  BatchOutcome sort_batch(vector<vector<T>>& nums_batch, const CancellationToken& token,
+                          chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max(),
+                          Engine engine = Engine::quicksort) {
+    return submit_batch(nums_batch, token, deadline, engine).get();
+  }
+
+  // Only the first k numbers of every vector end up sorted (the k smallest, in order), the rest in no particular order.
+  // After partitioning only the sides holding some of the first k positions are worked on,
+  // which is O(n + k log k) per vector instead of O(n log n).
+  void partial_sort_batch(vector<vector<T>>& nums_batch, const int k) {
+    assert(k >= 0);
+    submit_selection(nums_batch, Engine::quicksort, Selection::first, k).get();
+  }
+
+  // Puts the number which sorting would put at position nth in its place in every vector,
+  // everything before it is not greater and everything after it not smaller. Vectors with at most nth numbers stay as they are.
+  // Only the side holding position nth is followed after every partition, O(n) per vector.
+  void nth_element_batch(vector<vector<T>>& nums_batch, const int nth) {
+    assert(nth >= 0);
+    submit_selection(nums_batch, Engine::quicksort, Selection::nth, nth).get();
+  }
+
+  // The k smallest numbers of all the vectors together, in order.
+  // The vectors are partially sorted (partial_sort_batch()) and their first k numbers merged.
+  vector<T> top_k(vector<vector<T>>& nums_batch, const int k) {
+    partial_sort_batch(nums_batch, k);
+    vector<span<const T>> firsts;
+    size_t total = 0;
+    for (auto& nums: nums_batch) {
+      firsts.push_back(span<const T>(nums.data(), min<size_t>(k, nums.size())));
+      total += firsts.back().size();
     }
-    {
-      // wait until batch finishes
-      unique_lock lk(batch_mtx);
-      batch_cv.wait(lk, [this](){
-        return in_progress_tasks == 0;
-      });
+    vector<T> smallest(min<size_t>(k, total));
+    merge_window(firsts, 0, smallest.size(), smallest.data());
+    return smallest;
+  }
+
+  // Sorts one (typically huge) vector.
+  // The first passes over it are done by all the workers together, see Grain::parallel_partition_cutoff
+  void sort(vector<T>& nums, Engine engine = Engine::quicksort) {
+    submit(nums, engine).get();
+  }
+
+  // Sorts keys_batch[i] and moves payloads_batch[i] along with it, see key_value.hpp.
+  // Every key vector is sorted by one worker, the workers take them on one by one.
+  template<typename P>
+  void sort_by_key_batch(vector<vector<T>>& keys_batch, vector<vector<P>>& payloads_batch) {
+    assert(keys_batch.size() == payloads_batch.size());
+    if (keys_batch.empty()) {
+      return;
     }
+    parallel_for(keys_batch.size(), -1, [&](int i) {
+      key_value::sort_by_key(keys_batch[i], payloads_batch[i], comp, proj);
+    });
+  }
 
+  // key_value::argsort() of every vector, the vectors themselves stay as they are
+  vector<vector<uint32_t>> argsort_batch(const vector<vector<T>>& keys_batch) {
+    vector<vector<uint32_t>> indices_batch(keys_batch.size());
+    if (keys_batch.empty()) {
+      return indices_batch;
+    }
+    parallel_for(keys_batch.size(), -1, [&](int i) {
+      indices_batch[i] = key_value::argsort(keys_batch[i], comp, proj);
+    });
+    return indices_batch;
+  }
+
+  // Merges the sorted vectors of sorted_batch (e.g. fresh out of sort_batch()) into out, on all the workers.
+  // The output is cut into slices, merge::co_rank() finds where every slice starts in every vector,
+  // so the workers merge disjoint slices without talking to each other.
+  void merge_batch(const vector<vector<T>>& sorted_batch, vector<T>& out) {
+    size_t total = 0;
+    for (auto& run: sorted_batch) {
+      total += run.size();
+    }
+    out.resize(total);
+    merge_window(sorted_batch, 0, total, out.data());
+  }
+
+  // The same for sorted runs which don't live in vectors of their own, e.g. the buffers of an external sort.
+  // out needs room for all of them.
+  void merge_runs(const vector<span<const T>>& sorted_runs, T* out) {
+    size_t total = 0;
+    for (auto& run: sorted_runs) {
+      total += run.size();
+    }
+    merge_window(sorted_runs, 0, total, out);
+  }
+
+  // The same merge handed to consume(const T* nums, size_t count) in order, chunk_size numbers at a time,
+  // so the merged output never has to exist in one piece. Every chunk is merged by all the workers.
+  template<typename Consumer>
+  void merge_batch_chunked(const vector<vector<T>>& sorted_batch, const size_t chunk_size, Consumer consume) {
+    assert(chunk_size > 0);
+    size_t total = 0;
+    for (auto& run: sorted_batch) {
+      total += run.size();
+    }
+    vector<T> chunk(min(chunk_size, total));
+    for (size_t first = 0; first < total; first += chunk_size) {
+      const size_t last = min(total, first + chunk_size);
+      merge_window(sorted_batch, first, last, chunk.data());
+      consume(static_cast<const T*>(chunk.data()), last - first);
+    }
   }
 
 
 private:
   vector<thread> workers;
-  queue<Task> task_q;
-  mutex task_q_mtx;
-  atomic<int> in_progress_tasks;
-  mutex batch_mtx;
-  condition_variable batch_cv;;
+  // unique_ptr because the queues hold a mutex which can't be moved around when the vector grows
+  vector<unique_ptr<WorkStealingQueue<T>>> task_queues;
+  atomic<bool> done = false;
+  atomic<size_t> next_queue = 0;
 
-  void worker() {
-    while (true) {
-      optional<Task> task_opt;
-      {
-        lock_guard lk(task_q_mtx);
-        if (!task_q.empty()) {
-          // create in-place with emplace because Task can't be default constructed 
-          // due to nums being a refernece
-          task_opt.emplace(task_q.front());
-          task_q.pop();
+  IdlePolicy idle_policy;
+  Grain grain;
+  Compare comp;
+  Projection proj;
+  // Parked workers sleep with atomic::wait() on work_epoch (a futex on linux)
+  // and get woken up by bumping it. parked_workers lets the pushers skip the
+  // bump and the syscall when nobody is sleeping, which is the common case under load.
+  atomic<uint32_t> work_epoch = 0;
+  atomic<int> parked_workers = 0;
+
+  // NUMA placement, see Config::numa_aware
+  bool numa_aware = false;
+  topology::Topology topology;
+  // the node of every worker and the workers of every node
+  vector<int> worker_node;
+  vector<vector<int>> node_workers;
+  // the cpus every worker gets pinned to, empty = not pinned
+  vector<vector<int>> worker_cpus;
+  // The vectors submitted without a client waiting for a worker of their node, one queue per node.
+  // Not the workers' own queues: a worker waiting in parallel_for() must never find somebody else's vector
+  // pushed on top of its helpers. Only used when NUMA aware.
+  vector<unique_ptr<WorkStealingQueue<T>>> node_inboxes;
+  atomic<long long> cross_node_steals_count = 0;
+
+  // The clients and their queues of vectors not started yet, see add_client().
+  // clients_mtx guards the list and the round robin state, the queues have their own mutex.
+  struct Client {
+    Priority priority;
+    int weight;
+    // vectors it may still start in its current turn
+    int credits;
+    WorkStealingQueue<T> roots;
+
+    Client(Priority priority, int weight): priority(priority), weight(weight), credits(weight) {}
+  };
+  mutex clients_mtx;
+  vector<unique_ptr<Client>> clients;
+  vector<int> clients_by_priority[NUM_PRIORITIES];
+  size_t client_cursors[NUM_PRIORITIES] = {};
+  // vectors waiting in the client queues of every class, lets the workers skip clients_mtx when there are none
+  atomic<int> pending_roots[NUM_PRIORITIES] = {};
+
+  // see stats.hpp, one of each per worker
+  vector<unique_ptr<stats::WorkerCounters>> worker_counters;
+  vector<unique_ptr<stats::TraceBuffer>> worker_traces;
+  stats::TraceBuffer batch_trace;
+  atomic<bool> tracing = false;
+  atomic<uint64_t> trace_origin_ns = 0;
+  atomic<uint64_t> next_batch_id = 1;
+
+  void place_workers(const int num_workers, const Config& config) {
+    numa_aware = config.numa_aware;
+    if (numa_aware) {
+      topology = config.topology.has_value() ? config.topology.value() : topology::Topology::detect();
+    }
+    worker_node.assign(num_workers, 0);
+    worker_cpus.assign(num_workers, {});
+    // nodes without any cpu we may use can't get workers
+    vector<int> usable_nodes;
+    for (int node = 0; numa_aware && node < topology.number_of_nodes(); node++) {
+      if (!topology.node_cpus[node].empty()) {
+        usable_nodes.push_back(node);
+      }
+    }
+    for (int i=0; i < num_workers; i++) {
+      if (!config.cpus.empty()) {
+        const int cpu = config.cpus[i % config.cpus.size()];
+        worker_cpus[i] = {cpu};
+        worker_node[i] = numa_aware ? topology.node_of_cpu(cpu) : 0;
+      } else if (!usable_nodes.empty()) {
+        // deal the workers out over the nodes, each one may float between the cpus of its node
+        worker_node[i] = usable_nodes[i % usable_nodes.size()];
+        worker_cpus[i] = topology.node_cpus[worker_node[i]];
+      }
+    }
+    node_workers.assign(numa_aware ? max(1, topology.number_of_nodes()) : 1, {});
+    for (int i=0; i < num_workers; i++) {
+      node_workers[worker_node[i]].push_back(i);
+    }
+  }
+
+  // The node inbox a new vector goes to, the nth one submitted.
+  // The node holding the vector, round robin over the nodes when that can't be told or the node has no workers.
+  size_t home_node(const vector<T>& nums, const size_t nth) {
+    const int node = nums.empty() ? -1 : topology.node_of_memory(nums.data());
+    if (node < 0 || node >= static_cast<int>(node_workers.size()) || node_workers[node].empty()) {
+      return nth % node_inboxes.size();
+    }
+    return node;
+  }
+
+  future<void> submit_selection(vector<vector<T>>& nums_batch, Engine engine, Selection selection, int rank,
+                                unique_ptr<Cancellable> cancellable = nullptr, int client = -1) {
+    check_engine(engine);
+    if (nums_batch.empty()) {
+      promise<void> nothing_to_do;
+      nothing_to_do.set_value();
+      return nothing_to_do.get_future();
+    }
+    // deleted by the worker finishing its last task
+    Batch* batch = new Batch();
+    batch->in_progress_tasks = nums_batch.size();
+    batch->num_vectors = nums_batch.size();
+    batch->engine = engine;
+    batch->selection = selection;
+    batch->rank = rank;
+    batch->cancellable = move(cancellable);
+    stamp(batch);
+    future<void> completed = batch->completed.get_future();
+    const size_t first_queue = next_queue.fetch_add(nums_batch.size());
+    for (size_t i=0; i < nums_batch.size(); i++) {
+      vector<T>& nums = nums_batch[i];
+      push_root({
+        .start_index = 0,
+        .end_index = static_cast<int>(nums.size() - 1),
+        .bad_partitions_left = sequential::bad_partition_budget(nums.size()),
+        .vector_index = static_cast<int>(i),
+        .nums = &nums,
+        .batch = batch,
+        .job = nullptr
+      }, client >= 0 ? client : default_client(), first_queue + i);
+    }
+    wake_parked_workers(true);
+    return completed;
+  }
+
+  // With NUMA placement the vectors submitted without a client skip the client queues and go
+  // to the workers next to their memory (see home_node()), a client queue would hand them to whoever comes first.
+  int default_client() {
+    return numa_aware ? -1 : 0;
+  }
+
+  // Queues the task of a whole vector, the nth one submitted, with the client or in the inbox of its node (client -1).
+  void push_root(const Task<T>& task, const int client, const size_t nth) {
+    if (client < 0) {
+      node_inboxes[home_node(*task.nums, nth)]->push(task);
+      return;
+    }
+    Client* c;
+    {
+      lock_guard lk(clients_mtx);
+      c = clients.at(client).get();
+    }
+    c->roots.push(task);
+    // after the push, see wait_for_task() for why
+    pending_roots[static_cast<int>(c->priority)] += 1;
+  }
+
+  // The next vector to start from the clients of the class, weighted round robin.
+  // The client at the cursor hands out up to weight vectors in a row, then it's the next one's turn.
+  optional<Task<T>> admit(const Priority priority) {
+    const int p = static_cast<int>(priority);
+    if (pending_roots[p] == 0) {
+      return nullopt;
+    }
+    lock_guard lk(clients_mtx);
+    vector<int>& ring = clients_by_priority[p];
+    size_t& cursor = client_cursors[p];
+    // two rounds at most, the first one may only refill the credits
+    for (size_t tries = 0; tries < 2 * ring.size(); tries++) {
+      Client& client = *clients[ring[cursor]];
+      if (client.credits > 0) {
+        // the oldest vector first
+        auto task_opt = client.roots.try_steal();
+        if (task_opt.has_value()) {
+          client.credits--;
+          pending_roots[p] -= 1;
+          return task_opt;
         }
       }
-      if (!task_opt.has_value()) {
-        this_thread::yield(); 
+      client.credits = client.weight;
+      cursor = (cursor + 1) % ring.size();
+    }
+    return nullopt;
+  }
+
+  // whether the positions [start, end] have to be sorted for the batch
+  static bool is_needed(const Batch& batch, const int start, const int end) {
+    switch (batch.selection) {
+      case Selection::first:
+        return start < batch.rank;
+      case Selection::nth:
+        return start <= batch.rank && batch.rank <= end;
+      default:
+        return true;
+    }
+  }
+
+  // Whether what is left of the batch is to be dropped, see submit_batch() with a CancellationToken.
+  // Plain batches only pay for the null check.
+  static bool is_dropped(Batch& batch) {
+    Cancellable* cancellable = batch.cancellable.get();
+    if (cancellable == nullptr) {
+      return false;
+    }
+    if (cancellable->dropped.load(memory_order_relaxed)) {
+      return true;
+    }
+    if (cancellable->token.is_cancelled() || chrono::steady_clock::now() >= cancellable->deadline) {
+      cancellable->dropped = true;
+      return true;
+    }
+    return false;
+  }
+
+  // the task is thrown away, so its vector won't be sorted completely
+  void drop_task(const Task<T>& task) {
+    task.batch->cancellable->vector_dropped[task.vector_index] = true;
+    finish_task(task.batch);
+  }
+
+  void stamp(Batch* batch) {
+    if constexpr (stats::ENABLED) {
+      batch->id = next_batch_id++;
+      batch->submitted_ns = stats::now_ns();
+    }
+  }
+
+  void check_engine(Engine engine) {
+    if (engine == Engine::radix && !radix_supported) {
+      throw invalid_argument("The radix engine only supports plain ints sorted in ascending order");
+    }
+  }
+
+  // High priority vectors, our own queue, our node's inbox, normal priority vectors, stealing
+  // (the other nodes' inboxes last) and only then low priority vectors.
+  // The vectors already started are finished before new ones of the same class, that keeps the number of
+  // half sorted vectors (and the memory they hog in the cache) down.
+  optional<Task<T>> find_task(const int worker_index, minstd_rand& rand_eng) {
+    auto task_opt = admit(Priority::high);
+    if (task_opt.has_value()) {
+      return task_opt;
+    }
+    task_opt = task_queues[worker_index]->try_pop();
+    if (task_opt.has_value()) {
+      return task_opt;
+    }
+    if (numa_aware) {
+      // the oldest vector first
+      task_opt = node_inboxes[worker_node[worker_index]]->try_steal();
+      if (task_opt.has_value()) {
+        return task_opt;
+      }
+    }
+    task_opt = admit(Priority::normal);
+    if (task_opt.has_value()) {
+      return task_opt;
+    }
+    // start from a random victim so that thieves don't all gang up on the same queue
+    const int n = task_queues.size();
+    const int first_victim = rand_eng() % n;
+    // with NUMA placement the victims on our own node come first, the others only once our node has run dry
+    const int passes = node_workers.size() > 1 ? 2 : 1;
+    for (int pass = 0; pass < passes; pass++) {
+      for (int i=0; i < n; i++) {
+        const int victim = (first_victim + i) % n;
+        const bool same_node = worker_node[victim] == worker_node[worker_index];
+        if (victim == worker_index || (passes == 2 && same_node != (pass == 0))) {
+          continue;
+        }
+        auto stolen_opt = task_queues[victim]->try_steal();
+        if (stolen_opt.has_value()) {
+          if (!same_node) {
+            cross_node_steals_count += 1;
+          }
+          worker_counters[worker_index]->steals.add(1);
+          return stolen_opt;
+        }
+        worker_counters[worker_index]->failed_steals.add(1);
+      }
+    }
+    for (size_t node=0; node < node_inboxes.size(); node++) {
+      if (static_cast<int>(node) == worker_node[worker_index]) {
         continue;
       }
-      Task task = task_opt.value();
-      if (task.poison) {
-        break;
+      auto stolen_opt = node_inboxes[node]->try_steal();
+      if (stolen_opt.has_value()) {
+        cross_node_steals_count += 1;
+        worker_counters[worker_index]->steals.add(1);
+        return stolen_opt;
       }
-      auto pivot_rslt = concurrent::arrange_around_pivot(task.start_index, task.end_index, task.nums);
-      if (pivot_rslt.pivoted) {
-        scoped_lock lk(task_q_mtx, batch_mtx);
-        task_q.push({
-          .start_index = task.start_index,
-          .end_index = max(pivot_rslt.pivot_boundry_left, task.start_index),
-          .nums = task.nums,
-          .poison = false
-        });
-        task_q.push({
-          .start_index = min(pivot_rslt.pivot_boundry_right, task.end_index),
-          .end_index = task.end_index,
+    }
+    return admit(Priority::low);
+  }
+
+  void wake_parked_workers(bool all) {
+    if (parked_workers == 0) {
+      return;
+    }
+    work_epoch += 1;
+    if (all) {
+      work_epoch.notify_all();
+    } else {
+      work_epoch.notify_one();
+    }
+  }
+
+  optional<Task<T>> wait_for_task(const int worker_index, minstd_rand& rand_eng) {
+    const auto spin_until = chrono::steady_clock::now() + idle_policy.spin_duration;
+    stats::WorkerCounters& counters = *worker_counters[worker_index];
+    // everything outside of the parking counts as spinning
+    uint64_t spin_start = stats::ENABLED ? stats::now_ns() : 0;
+    auto count_spin = [&]() {
+      if constexpr (stats::ENABLED) {
+        counters.spin_ns.add(stats::now_ns() - spin_start);
+      }
+    };
+    while (!done) {
+      auto task_opt = find_task(worker_index, rand_eng);
+      if (task_opt.has_value()) {
+        count_spin();
+        return task_opt;
+      }
+      if (chrono::steady_clock::now() < spin_until) {
+        this_thread::yield();
+        continue;
+      }
+      // Park.
+      // The epoch is read before announcing ourself and looking for the task one last time.
+      // A pusher either pushes before our last look (we find the task),
+      // or after it, then it sees parked_workers > 0 (the queue mutex orders the two,
+      // for the client queues it's pending_roots) and bumps the epoch so that the wait returns immediately instead of sleeping.
+      const uint32_t epoch = work_epoch;
+      parked_workers += 1;
+      auto last_look_opt = find_task(worker_index, rand_eng);
+      if (!last_look_opt.has_value() && !done) {
+        count_spin();
+        const uint64_t park_start = stats::ENABLED ? stats::now_ns() : 0;
+        work_epoch.wait(epoch);
+        if constexpr (stats::ENABLED) {
+          spin_start = stats::now_ns();
+          counters.parked_ns.add(spin_start - park_start);
+        }
+      }
+      parked_workers -= 1;
+      if (last_look_opt.has_value()) {
+        count_spin();
+        return last_look_opt;
+      }
+    }
+    count_spin();
+    return nullopt;
+  }
+
+  void finish_task(Batch* batch) {
+    if (batch->in_progress_tasks.fetch_sub(1) == 1) {
+      if constexpr (stats::ENABLED) {
+        if (tracing) {
+          batch_trace.add({ .name = "batch", .start_ns = batch->submitted_ns, .end_ns = stats::now_ns(),
+                            .batch_id = batch->id });
+        }
+      }
+      // Only the last task of the batch completes it.
+      // Nobody else touches the batch anymore, the future keeps its own reference to the shared state.
+      // The fetch_sub() above made the vector_dropped flags of the other workers visible.
+      if (batch->cancellable != nullptr) {
+        Cancellable& cancellable = *batch->cancellable;
+        BatchOutcome outcome;
+        for (int i=0; i < batch->num_vectors; i++) {
+          outcome.completed.push_back(!cancellable.vector_dropped[i]);
+        }
+        cancellable.outcome.set_value(move(outcome));
+      }
+      batch->completed.set_value();
+      delete batch;
+    }
+  }
+
+  // a range sort_task() keeps to itself
+  struct Range {
+    int start;
+    int end;
+    int bad_partitions_left;
+  };
+
+  // Whatever a worker needs while sorting, kept for the life of the worker
+  // so that the vectors keep their capacity and sorting doesn't allocate once they are big enough.
+  // A worker is only ever in one sort_task() at a time (it runs nothing else while waiting in parallel_for()),
+  // so there is no nested use.
+  struct WorkerScratch {
+    vector<Range> private_ranges;
+    vector<int> block_heads;
+    vector<pair<int, int>> misplaced_left;
+    vector<pair<int, int>> misplaced_right;
+    vector<int> radix_temp;
+    vector<radix::Histogram> chunk_offsets;
+
+    explicit WorkerScratch(int num_workers) {
+      private_ranges.reserve(256);
+      // parallel_partition() cuts ranges into 4 blocks per worker
+      block_heads.reserve(num_workers * 4);
+      misplaced_left.reserve(num_workers * 4);
+      misplaced_right.reserve(num_workers * 4);
+      chunk_offsets.reserve(num_workers);
+    }
+  };
+
+  // Runs body(0) ... body(num_chunks - 1) on as many workers as useful and returns when all of them are done.
+  // The calling worker takes part itself. Helpers are pushed on its own queue for the others to steal,
+  // the ones nobody got around to stealing are taken back out once all the chunks are claimed.
+  // A thread which isn't a worker (worker_index -1) borrows the queue of the next worker in line.
+  //
+  // The helpers left in the queue may be buried under anything pushed after them (a root task, the helpers
+  // of a non-worker's job) and every other worker may be waiting in here as well, so nobody may be left to steal them.
+  // That's why they are removed wherever they sit instead of being popped from the front,
+  // then only the helpers already running are waited for and those never block.
+  template<typename Body>
+  void parallel_for(const int num_chunks, const int worker_index, const Body& body) {
+    ParallelJob job{
+      .body = &body,
+      .call_body = [](const void* body, int chunk) { (*static_cast<const Body*>(body))(chunk); },
+      .num_chunks = num_chunks
+    };
+    const int num_helpers = min(num_chunks, number_of_workers()) - 1;
+    job.pending_helpers = num_helpers;
+    WorkStealingQueue<T>& local_q = *task_queues[worker_index >= 0 ? worker_index : next_queue++ % task_queues.size()];
+    for (int i=0; i < num_helpers; i++) {
+      local_q.push({ .start_index = -1, .end_index = -1, .bad_partitions_left = 0, .vector_index = 0, .nums = nullptr,
+                     .batch = nullptr,
+                     .job = &job });
+    }
+    wake_parked_workers(true);
+    job.run_chunks();
+    // all the chunks are claimed, a helper started now would find nothing left to do
+    job.pending_helpers -= local_q.remove_helpers(&job);
+    // The job lives on our stack, so we can't leave while a helper could still touch it.
+    while (job.pending_helpers > 0) {
+      this_thread::yield();
+    }
+  }
+
+  void run_helper(const Task<T>& task) {
+    if (stats::current_worker != nullptr) {
+      stats::current_worker->helper_tasks.add(1);
+    }
+    task.job->run_chunks();
+    // the job may be gone right after this
+    task.job->pending_helpers -= 1;
+  }
+
+  // Merges the output positions [first, last) of the runs into out, in slices on all the workers.
+  // Called by the thread merging, not by a worker.
+  template<typename Runs>
+  void merge_window(const Runs& runs, const size_t first, const size_t last, T* out) {
+    // below this a slice isn't worth the two co_rank() searches
+    constexpr size_t MIN_SLICE = 1 << 14;
+    const size_t n = last - first;
+    const int num_slices = max<size_t>(1, min<size_t>(number_of_workers() * 4, n / MIN_SLICE));
+    parallel_for(num_slices, -1, [&](int s) {
+      const size_t slice_first = first + n * s / num_slices;
+      const size_t slice_last = first + n * (s + 1) / num_slices;
+      vector<int> from;
+      vector<int> to;
+      merge::co_rank(runs, slice_first, from, comp, proj);
+      merge::co_rank(runs, slice_last, to, comp, proj);
+      merge::merge_slices(runs, from, to, out + (slice_first - first), comp, proj);
+    });
+  }
+
+  // Partitions [start, end] so that the numbers satisfying pred come first, on all the workers.
+  // Returns the index of the first number not satisfying pred.
+  //
+  // 1. The range is cut into blocks and every block is partitioned on its own.
+  // 2. Knowing how many numbers satisfy pred in total tells where the boundary will be.
+  //    Left of it, the misplaced numbers are the tails of the blocks (not satisfying pred),
+  //    right of it, the heads of the blocks (satisfying pred). There are exactly as many of each,
+  //    so the k-th misplaced number on the left is swapped with the k-th on the right,
+  //    again split into chunks over all the workers.
+  template<typename Predicate>
+  int parallel_partition(const int start, const int end, vector<T>& nums, Predicate pred,
+                         const int worker_index, WorkerScratch& scratch) {
+    const int n = end - start + 1;
+    const int block_size = (n + number_of_workers() * 4 - 1) / (number_of_workers() * 4);
+    const int num_blocks = (n + block_size - 1) / block_size;
+    // number of numbers satisfying pred in every block after partitioning it
+    vector<int>& block_heads = scratch.block_heads;
+    block_heads.assign(num_blocks, 0);
+    parallel_for(num_blocks, worker_index, [&](int b) {
+      const int block_start = start + b * block_size;
+      const int block_end = min(end, block_start + block_size - 1);
+      int i = block_start;
+      for (int j = block_start; j <= block_end; j++) {
+        if (pred(nums[j])) {
+          swap(i, j, nums);
+          i++;
+        }
+      }
+      block_heads[b] = i - block_start;
+    });
+
+    int boundary = start;
+    for (int heads: block_heads) {
+      boundary += heads;
+    }
+
+    // misplaced stretches as (first index, length)
+    vector<pair<int, int>>& misplaced_left = scratch.misplaced_left;
+    vector<pair<int, int>>& misplaced_right = scratch.misplaced_right;
+    misplaced_left.clear();
+    misplaced_right.clear();
+    int num_misplaced = 0;
+    for (int b=0; b < num_blocks; b++) {
+      const int block_start = start + b * block_size;
+      const int block_end = min(end, block_start + block_size - 1);
+      const int first_tail = block_start + block_heads[b];
+      if (first_tail < boundary && first_tail <= block_end) {
+        misplaced_left.push_back({first_tail, min(block_end, boundary - 1) - first_tail + 1});
+        num_misplaced += misplaced_left.back().second;
+      }
+      if (first_tail > boundary && block_heads[b] > 0) {
+        const int first = max(block_start, boundary);
+        misplaced_right.push_back({first, first_tail - first});
+      }
+    }
+    if (num_misplaced == 0) {
+      return boundary;
+    }
+
+    // seeks to the k-th misplaced number, then walks through the stretches
+    struct Cursor {
+      const vector<pair<int, int>>& stretches;
+      size_t stretch = 0;
+      int offset = 0;
+
+      Cursor(const vector<pair<int, int>>& stretches, int k): stretches(stretches) {
+        while (k >= stretches[stretch].second) {
+          k -= stretches[stretch].second;
+          stretch++;
+        }
+        offset = k;
+      }
+      int index() const {
+        return stretches[stretch].first + offset;
+      }
+      void next() {
+        if (++offset == stretches[stretch].second) {
+          stretch++;
+          offset = 0;
+        }
+      }
+    };
+
+    const int num_chunks = min(num_misplaced, number_of_workers() * 4);
+    const int chunk_size = (num_misplaced + num_chunks - 1) / num_chunks;
+    parallel_for(num_chunks, worker_index, [&](int c) {
+      const int from = c * chunk_size;
+      const int to = min(num_misplaced, from + chunk_size);
+      if (from >= to) {
+        return;
+      }
+      Cursor left(misplaced_left, from);
+      Cursor right(misplaced_right, from);
+      for (int k = from; k < to; k++) {
+        swap(left.index(), right.index(), nums);
+        left.next();
+        right.next();
+      }
+    });
+    return boundary;
+  }
+
+  // Same result as arrange_around_pivot() but on all the workers.
+  // Done as two 2-way partitions, [< pivot | >= pivot] and then [== pivot | > pivot] on the right side.
+  PivotResult parallel_arrange_around_pivot(const int start, const int end, vector<T>& nums,
+                                            const int worker_index, WorkerScratch& scratch) {
+    const KeyOf<T, Projection> pivot = invoke(proj, nums[sequential::choose_pivot(start, end, nums, comp, proj)]);
+    const int less_end = parallel_partition(start, end, nums,
+      [&](const T& num){ return comp(invoke(proj, num), pivot); }, worker_index, scratch);
+    // everything right of less_end is >= pivot, so not greater means equal
+    const int equal_end = parallel_partition(less_end, end, nums,
+      [&](const T& num){ return !comp(pivot, invoke(proj, num)); }, worker_index, scratch);
+    return {
+      .pivoted = true,
+      .pivot_boundry_left = less_end - 1,
+      .pivot_boundry_right = equal_end
+    };
+  }
+
+  // Radix sorts the whole vector of the task, small ones on this worker alone.
+  // For the big ones every pass is split into one chunk per worker:
+  // 1. every chunk counts its digits into its own histogram, no sharing between the workers
+  // 2. parallel prefix sum: every bucket (column) is scanned over the chunks independently,
+  //    which gives the position of a chunk within the bucket.
+  //    Only the 256 bucket totals are left to be summed up in order.
+  // 3. every chunk scatters its numbers to its own disjoint slots of the buckets
+  void radix_sort_task(const Task<T>& task, const int worker_index, WorkerScratch& scratch) {
+    vector<int>& nums = *task.nums;
+    const int n = nums.size();
+    if (n <= grain.parallel_partition_cutoff || number_of_workers() == 1) {
+      radix::radix_sort(nums, scratch.radix_temp);
+      finish_task(task.batch);
+      return;
+    }
+    const int num_chunks = number_of_workers();
+    const int chunk_size = (n + num_chunks - 1) / num_chunks;
+    auto chunk_bounds = [&](int c) {
+      return pair<int, int>{min(n, c * chunk_size), min(n, (c + 1) * chunk_size)};
+    };
+    // chunk_offsets[c][d]: position of chunk c within bucket d, after the scan
+    vector<radix::Histogram>& chunk_offsets = scratch.chunk_offsets;
+    chunk_offsets.resize(num_chunks);
+    radix::Histogram bucket_starts;
+    scratch.radix_temp.resize(n);
+    int* from = nums.data();
+    int* to = scratch.radix_temp.data();
+
+    for (int pass=0; pass < radix::PASSES; pass++) {
+      parallel_for(num_chunks, worker_index, [&](int c) {
+        auto [chunk_start, chunk_end] = chunk_bounds(c);
+        radix::count_digits(from + chunk_start, chunk_end - chunk_start, pass, chunk_offsets[c]);
+      });
+      radix::Histogram bucket_totals;
+      const int buckets_per_chunk = (radix::BUCKETS + num_chunks - 1) / num_chunks;
+      parallel_for(num_chunks, worker_index, [&](int c) {
+        for (int d = c * buckets_per_chunk; d < min(radix::BUCKETS, (c + 1) * buckets_per_chunk); d++) {
+          int sum = 0;
+          for (auto& offsets: chunk_offsets) {
+            const int count = offsets[d];
+            offsets[d] = sum;
+            sum += count;
+          }
+          bucket_totals[d] = sum;
+        }
+      });
+      if (radix::pass_is_noop(bucket_totals, n)) {
+        continue;
+      }
+      int sum = 0;
+      for (int d=0; d < radix::BUCKETS; d++) {
+        bucket_starts[d] = sum;
+        sum += bucket_totals[d];
+      }
+      parallel_for(num_chunks, worker_index, [&](int c) {
+        auto [chunk_start, chunk_end] = chunk_bounds(c);
+        radix::Histogram offsets;
+        for (int d=0; d < radix::BUCKETS; d++) {
+          offsets[d] = bucket_starts[d] + chunk_offsets[c][d];
+        }
+        radix::scatter(from + chunk_start, chunk_end - chunk_start, pass, offsets, to);
+      });
+      std::swap(from, to);
+    }
+    if (from != nums.data()) {
+      parallel_for(num_chunks, worker_index, [&](int c) {
+        auto [chunk_start, chunk_end] = chunk_bounds(c);
+        memcpy(nums.data() + chunk_start, from + chunk_start, (chunk_end - chunk_start) * sizeof(int));
+      });
+    }
+    finish_task(task.batch);
+  }
+
+  // Sorts the range of the task, publishing the big subranges on the way.
+  // The subranges kept on private_ranges are part of this task and don't need to be counted.
+  // Subranges the batch doesn't need (see Selection) are dropped right after the partition which split them off.
+  void sort_task(const Task<T>& task, const int worker_index, WorkerScratch& scratch) {
+    WorkStealingQueue<T>& local_q = *task_queues[worker_index];
+    vector<Range>& private_ranges = scratch.private_ranges;
+    vector<T>& nums = *task.nums;
+    if (is_needed(*task.batch, task.start_index, task.end_index)) {
+      private_ranges.push_back({task.start_index, task.end_index, task.bad_partitions_left});
+    }
+    while (!private_ranges.empty()) {
+      if (is_dropped(*task.batch)) {
+        // the ranges split off and published before are dropped by whoever pops them
+        private_ranges.clear();
+        drop_task(task);
+        return;
+      }
+      auto [start, end, bad_partitions_left] = private_ranges.back();
+      private_ranges.pop_back();
+      if (end - start + 1 <= grain.sequential_cutoff) {
+        sequential::quicksort_sequential(start, end, nums, comp, proj);
+        continue;
+      }
+      // see sequential.hpp, the same guards against quadratic inputs
+      if (bad_partitions_left == 0) {
+        sequential::heap_sort(start, end, nums, comp, proj);
+        continue;
+      }
+      if (sequential::sort_if_presorted(start, end, nums, comp, proj)) {
+        continue;
+      }
+      auto pivot_rslt = end - start + 1 > grain.parallel_partition_cutoff && number_of_workers() > 1
+        ? parallel_arrange_around_pivot(start, end, nums, worker_index, scratch)
+        : concurrent::arrange_around_pivot(start, end, nums, comp, proj);
+      worker_counters[worker_index]->elements_partitioned.add(end - start + 1);
+      if (!pivot_rslt.pivoted) {
+        continue;
+      }
+      const int less_size = pivot_rslt.pivot_boundry_left - start + 1;
+      const int greater_size = end - pivot_rslt.pivot_boundry_right + 1;
+      const bool bad_partition = sequential::is_unbalanced(end - start + 1, less_size, greater_size);
+      if (bad_partition) {
+        bad_partitions_left--;
+      }
+      const pair<int, int> halves[] = {
+        {start, max(pivot_rslt.pivot_boundry_left, start)},
+        {min(pivot_rslt.pivot_boundry_right, end), end}
+      };
+      for (auto [half_start, half_end]: halves) {
+        if (!is_needed(*task.batch, half_start, half_end)) {
+          continue;
+        }
+        if (bad_partition) {
+          sequential::break_patterns(half_start, half_end, nums);
+        }
+        if (half_end - half_start + 1 <= grain.publish_cutoff) {
+          private_ranges.push_back({half_start, half_end, bad_partitions_left});
+          continue;
+        }
+        // count the new task before publishing it
+        // so that the counter can never drop to 0 while work is still queued
+        task.batch->in_progress_tasks += 1;
+        local_q.push({
+          .start_index = half_start,
+          .end_index = half_end,
+          .bad_partitions_left = bad_partitions_left,
+          .vector_index = task.vector_index,
           .nums = task.nums,
-          .poison = false
+          .batch = task.batch,
+          .job = nullptr
         });
-        in_progress_tasks += 1;
+        // we are going to pop it ourself unless somebody else grabs it first
+        wake_parked_workers(false);
+      }
+    }
+    finish_task(task.batch);
+  }
+
+  void worker(const int worker_index) {
+    // pin before the scratch vectors are allocated, so they get first touched on our node
+    if (!worker_cpus[worker_index].empty()) {
+      topology::pin_current_thread(worker_cpus[worker_index]);
+    }
+    minstd_rand rand_eng(worker_index + 1);
+    WorkerScratch scratch(number_of_workers());
+    stats::WorkerCounters& counters = *worker_counters[worker_index];
+    stats::current_worker = &counters;
+    while (!done) {
+      optional<Task<T>> task_opt = wait_for_task(worker_index, rand_eng);
+      if (!task_opt.has_value()) {
+        break;
+      }
+      const uint64_t task_start = stats::ENABLED ? stats::now_ns() : 0;
+      // read before running the task, the batch may be gone afterwards
+      const uint64_t batch_id = task_opt->batch != nullptr ? task_opt->batch->id : 0;
+      const char* name = "helper";
+      if (task_opt->job != nullptr) {
+        run_helper(task_opt.value());
+      } else if (is_dropped(*task_opt->batch)) {
+        drop_task(task_opt.value());
+        name = "dropped";
+      } else if (task_opt->batch->engine == Engine::radix) {
+        if constexpr (radix_supported) {
+          radix_sort_task(task_opt.value(), worker_index, scratch);
+        }
+        name = "radix sort";
       } else {
-        // the update of atomic can take some time until published to all threads
-        // so when we notify the condition variable the update may not be available yet.
-        // To avoid this we should update the atomic while holding the mutex related to the condition variable.
-        {
-          lock_guard lk(batch_mtx);
-          in_progress_tasks -= 1;
+        sort_task(task_opt.value(), worker_index, scratch);
+        name = "sort";
+      }
+      if constexpr (stats::ENABLED) {
+        const uint64_t task_end = stats::now_ns();
+        counters.busy_ns.add(task_end - task_start);
+        if (task_opt->job == nullptr) {
+          counters.tasks_executed.add(1);
+        }
+        if (tracing) {
+          worker_traces[worker_index]->add({ .name = name, .start_ns = task_start, .end_ns = task_end,
+                                             .batch_id = batch_id });
         }
-        batch_cv.notify_one();
       }
     }
+    stats::current_worker = nullptr;
   }
 
 };
 
 
-void swap(int a, int b, vector<int>& nums) {
-  int temp = nums[a];
-  nums[a] = nums[b];
-  nums[b] = temp;
-}
-
-
-PivotResult arrange_around_pivot(const int start, const int end, vector<int>& nums) {
+template<typename T, typename Compare, typename Projection>
+PivotResult arrange_around_pivot(const int start, const int end, vector<T>& nums, Compare comp, Projection proj) {
   assert(start <= end);
   if (start == end) {
     return {
@@ -174,7 +1434,7 @@ PivotResult arrange_around_pivot(const int start, const int end, vector<int>& nu
     };
   }
   if (start + 1 == end) {
-    if (nums[end] < nums[start]) {
+    if (comp(invoke(proj, nums[end]), invoke(proj, nums[start]))) {
       swap(start, end, nums);
     }
     return {
@@ -183,26 +1443,9 @@ PivotResult arrange_around_pivot(const int start, const int end, vector<int>& nu
       .pivot_boundry_right = -1
     };
   }
-  int pivot = nums[(start + end) / 2];
-
-  // invariant:
-  // left of l is strictly smaller than pivot
-  // right or r is strictly greater than pivot
-  int l = start;
-  int r = end;
-
-  int i = l;
-  while (i <= r) {
-    if (nums[i] < pivot) {
-      swap(i, l, nums);
-      l++; i++;
-    } else if (nums[i] > pivot) {
-      swap(i, r, nums);
-      r--;
-    } else {
-      i++;
-    }
-  }
+  // a copy of the key, the element it came from is going to be moved around
+  KeyOf<T, Projection> pivot = invoke(proj, nums[sequential::choose_pivot(start, end, nums, comp, proj)]);
+  auto [l, r] = sequential::partition_around(start, end, nums, pivot, comp, proj);
 
   return {
     .pivoted = true,
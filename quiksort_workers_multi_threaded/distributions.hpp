@@ -0,0 +1,139 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <limits>
+#include <numeric>
+#include "sequential.hpp"
+
+// Input distributions for the benchmark suite (bench.cpp).
+// Quicksorts in particular behave very differently on presorted input or lots of duplicates,
+// so uniform random numbers alone say little about how a change does on real data.
+namespace distributions {
+
+using namespace std;
+
+
+const vector<string> ALL = {"uniform", "sorted", "reversed", "organ_pipe", "few_unique", "zipf", "sawtooth", "antiqsort"};
+
+
+// McIlroy's "A Killer Adversary for Quicksort".
+// sort(indices, less_than) sorts the indices 0 .. n-1 and the values behind them get decided only as they are compared.
+// Undecided values ("gas") are bigger than all decided ones. When two of them meet, one gets frozen to the next
+// smallest value, preferably the likely pivot (the gas value compared last). That way the pivot ends up as small
+// as possible and every partition peels off next to nothing, which drives a quicksort without a fallback to O(n^2).
+// Returns the values, sorting them again the same way takes the same path.
+template<typename Sort>
+vector<int> antiqsort(const size_t n, Sort sort) {
+  const int gas = static_cast<int>(n);
+  vector<int> values(n, gas);
+  int solid = 0;
+  int candidate = 0;
+  auto less_than = [&](int x, int y) {
+    if (values[x] == gas && values[y] == gas) {
+      values[x == candidate ? x : y] = solid++;
+    }
+    if (values[x] == gas) {
+      candidate = x;
+    } else if (values[y] == gas) {
+      candidate = y;
+    }
+    return values[x] < values[y];
+  };
+  vector<int> indices(n);
+  iota(indices.begin(), indices.end(), 0);
+  sort(indices, less_than);
+  // whatever was never compared to another gas value
+  for (int& value: values) {
+    if (value == gas) {
+      value = solid++;
+    }
+  }
+  return values;
+}
+
+
+// s = 1 over the ZIPF_VALUES distinct values 0 .. ZIPF_VALUES - 1, value k comes up with probability ~ 1/(k + 1)
+constexpr int ZIPF_VALUES = 1 << 20;
+
+class Zipf {
+public:
+  explicit Zipf(double s = 1.0): cdf(ZIPF_VALUES) {
+    double total = 0;
+    for (int k=0; k < ZIPF_VALUES; k++) {
+      total += 1.0 / pow(k + 1, s);
+      cdf[k] = total;
+    }
+    for (double& c: cdf) {
+      c /= total;
+    }
+  }
+
+  template<typename RandomEngine>
+  int operator()(RandomEngine& rand_eng) {
+    const double u = uniform_real_distribution<double>(0, 1)(rand_eng);
+    return lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+  }
+
+private:
+  vector<double> cdf;
+};
+
+
+// n numbers of the given distribution, the same ones for the same seed
+vector<int> generate(const string& distribution, const size_t n, const unsigned seed = 42) {
+  mt19937 rand_eng(seed);
+  vector<int> nums(n);
+  if (distribution == "uniform") {
+    uniform_int_distribution<int> uniform(numeric_limits<int>::min(), numeric_limits<int>::max());
+    for (int& num: nums) {
+      num = uniform(rand_eng);
+    }
+  } else if (distribution == "sorted" || distribution == "reversed") {
+    // evenly spread over the int range rather than 0, 1, 2 ... so the radix passes can't be skipped
+    const double step = n > 1 ? 4294967295.0 / (n - 1) : 0;
+    for (size_t i=0; i < n; i++) {
+      nums[i] = static_cast<int>(static_cast<long long>(i * step) + numeric_limits<int>::min());
+    }
+    if (distribution == "reversed") {
+      reverse(nums.begin(), nums.end());
+    }
+  } else if (distribution == "organ_pipe") {
+    // 0, 1, ..., n/2, ..., 1, 0
+    for (size_t i=0; i < n; i++) {
+      nums[i] = static_cast<int>(min(i, n - 1 - i));
+    }
+  } else if (distribution == "few_unique") {
+    uniform_int_distribution<int> uniform(0, 15);
+    for (int& num: nums) {
+      num = uniform(rand_eng);
+    }
+  } else if (distribution == "sawtooth") {
+    // 16 ascending runs
+    const size_t period = max<size_t>(1, n / 16);
+    for (size_t i=0; i < n; i++) {
+      nums[i] = static_cast<int>(i % period);
+    }
+  } else if (distribution == "antiqsort") {
+    // crafted against our own sequential quicksort
+    if (n > 0) {
+      nums = antiqsort(n, [](vector<int>& indices, auto less_than) {
+        sequential::quicksort_sequential(0, static_cast<int>(indices.size()) - 1, indices, less_than);
+      });
+    }
+  } else if (distribution == "zipf") {
+    Zipf zipf;
+    for (int& num: nums) {
+      num = zipf(rand_eng);
+    }
+  } else {
+    throw invalid_argument("Unknown distribution " + distribution);
+  }
+  return nums;
+}
+
+}
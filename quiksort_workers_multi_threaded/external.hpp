@@ -0,0 +1,321 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <span>
+#include <future>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "concurrent.hpp"
+
+// Sorting binary files of int32 which don't fit in memory, on the workers.
+//
+// 1. Run generation: the input is mapped with mmap and cut into runs of ExternalSortConfig::run_size numbers.
+//    Every run is copied out, sorted by the workers and written to a temporary file.
+//    While one run is being sorted the next one is already copied out, so reading and sorting overlap.
+// 2. Merge: every run file is read through its own buffer of read_buffer_size numbers.
+//    All the numbers up to the smallest last number among the buffers can go out right away
+//    (everything still on disk is bigger), those are merged by the workers (QuicksortWorkers::merge_runs())
+//    into a write buffer and appended to the output. The buffers are then topped up,
+//    with the next block of every run already requested from the kernel (posix_fadvise) while we merge.
+//
+// Memory: 2 runs during run generation, one read buffer per run and one write buffer during the merge.
+namespace external {
+
+using namespace std;
+
+
+struct ExternalSortConfig {
+  // numbers per sorted run, two runs are in memory at a time
+  size_t run_size = size_t(1) << 26;
+  // numbers buffered per run while merging
+  size_t read_buffer_size = size_t(1) << 20;
+  // numbers merged before they are written out
+  size_t write_buffer_size = size_t(1) << 22;
+  // where the runs go, next to the output when empty
+  string temp_dir;
+};
+
+
+void throw_io_error(const string& what, const string& path) {
+  throw runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+void write_all(int fd, const int* nums, size_t count, const string& path) {
+  const char* bytes = reinterpret_cast<const char*>(nums);
+  size_t left = count * sizeof(int);
+  while (left > 0) {
+    const ssize_t written = write(fd, bytes, left);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_io_error("can't write", path);
+    }
+    bytes += written;
+    left -= written;
+  }
+}
+
+// reads up to count numbers from offset (in numbers), returns how many it got
+size_t read_at(int fd, int* nums, size_t count, size_t offset, const string& path) {
+  char* bytes = reinterpret_cast<char*>(nums);
+  size_t got = 0;
+  while (got < count * sizeof(int)) {
+    const ssize_t n = pread(fd, bytes + got, count * sizeof(int) - got, offset * sizeof(int) + got);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_io_error("can't read", path);
+    }
+    if (n == 0) {
+      break;
+    }
+    got += n;
+  }
+  return got / sizeof(int);
+}
+
+
+// Close the file / unmap the input when they go out of scope, also when an exception is thrown
+struct FileCloser {
+  int fd;
+  ~FileCloser() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+};
+
+struct Unmapper {
+  void* address;
+  size_t size;
+  ~Unmapper() {
+    if (address != nullptr) {
+      munmap(address, size);
+    }
+  }
+};
+
+
+// One sorted run on disk and the window of it we have in memory
+struct RunReader {
+  string path;
+  int fd = -1;
+  // numbers of the run not read from the file yet
+  size_t next_offset = 0;
+  size_t size = 0;
+  vector<int> buffer;
+  // the unmerged numbers are buffer[begin, end)
+  size_t begin = 0;
+  size_t end = 0;
+
+  RunReader() = default;
+  RunReader(const RunReader&) = delete;
+  ~RunReader() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool exhausted() const {
+    return next_offset == size;
+  }
+
+  // moves what is left to the front and fills the rest of the buffer from the file
+  void top_up() {
+    if (exhausted()) {
+      return;
+    }
+    memmove(buffer.data(), buffer.data() + begin, (end - begin) * sizeof(int));
+    end -= begin;
+    begin = 0;
+    const size_t got = read_at(fd, buffer.data() + end, min(buffer.size() - end, size - next_offset), next_offset, path);
+    end += got;
+    next_offset += got;
+    // ask for the next block now, so it is (hopefully) in the page cache by the time we need it
+    if (!exhausted()) {
+      posix_fadvise(fd, next_offset * sizeof(int), min(buffer.size(), size - next_offset) * sizeof(int), POSIX_FADV_WILLNEED);
+    }
+  }
+};
+
+
+// the paths of the runs written so far are added to run_paths, also if it throws
+void generate_runs(concurrent::QuicksortWorkers<int>& workers, const int* input, const size_t n,
+                   const ExternalSortConfig& config, const string& run_prefix, vector<string>& run_paths) {
+  vector<int> runs[2];
+  future<void> sorted[2];
+  // the workers may still be sorting a run when we bail out, it must outlive that
+  struct WaitForRuns {
+    future<void>* sorted;
+    ~WaitForRuns() {
+      for (int i=0; i < 2; i++) {
+        if (sorted[i].valid()) {
+          sorted[i].wait();
+        }
+      }
+    }
+  } wait_for_runs{sorted};
+  auto write_run = [&](const vector<int>& run) {
+    const string path = run_prefix + to_string(run_paths.size());
+    FileCloser file{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)};
+    if (file.fd < 0) {
+      throw_io_error("can't create", path);
+    }
+    run_paths.push_back(path);
+    write_all(file.fd, run.data(), run.size(), path);
+  };
+  const size_t num_runs = (n + config.run_size - 1) / config.run_size;
+  for (size_t r=0; r < num_runs; r++) {
+    vector<int>& run = runs[r % 2];
+    // the run sorted two rounds ago is done by now most of the time
+    if (sorted[r % 2].valid()) {
+      sorted[r % 2].get();
+      write_run(run);
+    }
+    const size_t first = r * config.run_size;
+    const size_t count = min(config.run_size, n - first);
+    run.assign(input + first, input + first + count);
+    sorted[r % 2] = workers.submit(run);
+  }
+  // the last two, in order
+  for (size_t r = num_runs - min<size_t>(num_runs, 2); r < num_runs; r++) {
+    sorted[r % 2].get();
+    write_run(runs[r % 2]);
+  }
+}
+
+void merge_runs(concurrent::QuicksortWorkers<int>& workers, const vector<string>& run_paths,
+                const string& output_path, const ExternalSortConfig& config) {
+  FileCloser out_file{open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+  if (out_file.fd < 0) {
+    throw_io_error("can't create", output_path);
+  }
+  vector<RunReader> readers(run_paths.size());
+  for (size_t r=0; r < run_paths.size(); r++) {
+    RunReader& reader = readers[r];
+    reader.path = run_paths[r];
+    reader.fd = open(reader.path.c_str(), O_RDONLY);
+    struct stat st;
+    if (reader.fd < 0 || fstat(reader.fd, &st) != 0) {
+      throw_io_error("can't open", reader.path);
+    }
+    posix_fadvise(reader.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader.size = st.st_size / sizeof(int);
+    reader.buffer.resize(min(config.read_buffer_size, reader.size));
+    reader.top_up();
+  }
+
+  vector<int> out(config.write_buffer_size);
+  vector<span<const int>> window(readers.size());
+  vector<size_t> window_end(readers.size());
+  while (true) {
+    // Everything up to the smallest last number of the runs which still have numbers on disk can go out,
+    // that run's buffer gets emptied completely so every round makes progress.
+    bool any_left = false;
+    bool any_on_disk = false;
+    int limit = numeric_limits<int>::max();
+    for (auto& reader: readers) {
+      if (reader.begin < reader.end) {
+        any_left = true;
+      }
+      if (!reader.exhausted()) {
+        any_on_disk = true;
+        limit = min(limit, reader.buffer[reader.end - 1]);
+      }
+    }
+    if (!any_left) {
+      break;
+    }
+    size_t total = 0;
+    for (size_t r=0; r < readers.size(); r++) {
+      RunReader& reader = readers[r];
+      const int* first = reader.buffer.data() + reader.begin;
+      const int* last = reader.buffer.data() + reader.end;
+      const int* cut = any_on_disk ? upper_bound(first, last, limit) : last;
+      window[r] = span<const int>(first, cut);
+      window_end[r] = cut - reader.buffer.data();
+      total += cut - first;
+    }
+    // at most write_buffer_size numbers at a time
+    for (size_t done = 0; done < total; ) {
+      // the first count numbers of the window, co_rank() tells how many of them come from every run
+      const size_t count = min(config.write_buffer_size, total - done);
+      vector<int> cuts;
+      merge::co_rank(window, count, cuts);
+      vector<span<const int>> chunk(readers.size());
+      for (size_t r=0; r < readers.size(); r++) {
+        chunk[r] = window[r].subspan(0, cuts[r]);
+        window[r] = window[r].subspan(cuts[r]);
+      }
+      workers.merge_runs(chunk, out.data());
+      write_all(out_file.fd, out.data(), count, output_path);
+      done += count;
+    }
+    for (size_t r=0; r < readers.size(); r++) {
+      RunReader& reader = readers[r];
+      reader.begin = window_end[r];
+      // keep the buffers full, the fuller they are the more goes out per round.
+      // An emptied one always, with a buffer of 1 number half of it is 0.
+      if (reader.begin == reader.end || reader.end - reader.begin <= reader.buffer.size() / 2) {
+        reader.top_up();
+      }
+    }
+  }
+}
+
+
+// Sorts the int32 numbers of input_path (native byte order) into output_path on the workers.
+// Throws runtime_error when a file can't be read or written.
+void sort_file(concurrent::QuicksortWorkers<int>& workers, const string& input_path, const string& output_path,
+               const ExternalSortConfig& config = {}) {
+  if (config.run_size == 0 || config.read_buffer_size == 0 || config.write_buffer_size == 0) {
+    throw invalid_argument("The run and buffer sizes must be at least 1");
+  }
+  vector<string> run_paths;
+  // the runs are temporary, whatever happens
+  struct RemoveRuns {
+    vector<string>& run_paths;
+    ~RemoveRuns() {
+      for (auto& path: run_paths) {
+        unlink(path.c_str());
+      }
+    }
+  } remove_runs{run_paths};
+  const string temp_dir = !config.temp_dir.empty() ? config.temp_dir
+    : (output_path.find('/') == string::npos ? "." : output_path.substr(0, output_path.rfind('/')));
+  const string run_prefix = temp_dir + "/" + output_path.substr(output_path.rfind('/') + 1)
+    + ".run" + to_string(getpid()) + "_";
+
+  {
+    FileCloser in_file{open(input_path.c_str(), O_RDONLY)};
+    struct stat st;
+    if (in_file.fd < 0 || fstat(in_file.fd, &st) != 0) {
+      throw_io_error("can't open", input_path);
+    }
+    const size_t n = st.st_size / sizeof(int);
+    Unmapper input{nullptr, n * sizeof(int)};
+    if (n > 0) {
+      void* mapped = mmap(nullptr, n * sizeof(int), PROT_READ, MAP_PRIVATE, in_file.fd, 0);
+      if (mapped == MAP_FAILED) {
+        throw_io_error("can't map", input_path);
+      }
+      input.address = mapped;
+      // read front to back once, the kernel can read ahead aggressively and drop the pages behind us
+      madvise(mapped, n * sizeof(int), MADV_SEQUENTIAL);
+    }
+    generate_runs(workers, static_cast<const int*>(input.address), n, config, run_prefix, run_paths);
+  }
+  merge_runs(workers, run_paths, output_path, config);
+}
+
+}
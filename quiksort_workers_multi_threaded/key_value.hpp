@@ -0,0 +1,176 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <functional>
+#include <utility>
+#include "sequential.hpp"
+
+// Sorting keys with payloads kept in an array of their own (struct of arrays).
+// Sorting a vector of fat records drags the whole record through every partition,
+// although only the key is ever looked at. Here the partitions compare on the keys only
+// and move payloads[i] in lockstep with keys[i], so the compares run over a dense array of keys.
+// argsort() is the same with the indices 0 .. n-1 as the payload.
+//
+// Same quicksort as sequential.hpp (sampled pivots, heapsort fallback, presorted check) but with Hoare partitions,
+// and without the AVX2 kernels which only know how to move the keys.
+namespace key_value {
+
+using namespace std;
+using sequential::KeyOf;
+
+
+template<typename K, typename P>
+void swap_rows(int a, int b, vector<K>& keys, vector<P>& payloads) {
+  sequential::swap(a, b, keys);
+  sequential::swap(a, b, payloads);
+}
+
+template<typename K, typename P, typename Compare, typename Projection>
+void insertion_sort(int start, int end, vector<K>& keys, vector<P>& payloads, Compare& comp, Projection& proj) {
+  for (int i=start+1; i <= end; i++) {
+    K key = move(keys[i]);
+    P payload = move(payloads[i]);
+    int j = i - 1;
+    while (j >= start && comp(invoke(proj, key), invoke(proj, keys[j]))) {
+      keys[j+1] = move(keys[j]);
+      payloads[j+1] = move(payloads[j]);
+      j--;
+    }
+    keys[j+1] = move(key);
+    payloads[j+1] = move(payload);
+  }
+}
+
+// Hoare partition of [start, end] around pivot: returns j with [start, j] not greater than pivot
+// and [j + 1, end] not smaller. Only the pairs on the wrong sides get swapped, about a quarter of the keys
+// on random data where the 3 way partition of sequential.hpp moves most of them, which adds up with payloads along.
+// Numbers equal to the pivot stop both scans, so they get spread over both sides and duplicates don't unbalance it.
+// The pivot has to come from choose_pivot(), there is always another key not smaller and one not greater than it,
+// that's what stops the scans at the ends and keeps both sides non empty.
+template<typename K, typename P, typename Compare, typename Projection>
+int partition_around(int start, int end, vector<K>& keys, vector<P>& payloads,
+                     const KeyOf<K, Projection>& pivot, Compare& comp, Projection& proj) {
+  int i = start - 1;
+  int j = end + 1;
+  while (true) {
+    do {
+      i++;
+    } while (comp(invoke(proj, keys[i]), pivot));
+    do {
+      j--;
+    } while (comp(pivot, invoke(proj, keys[j])));
+    if (i >= j) {
+      return j;
+    }
+    swap_rows(i, j, keys, payloads);
+  }
+}
+
+// the heap is [start, start + size), root and its children are offsets into it
+template<typename K, typename P, typename Compare, typename Projection>
+void sift_down(int start, int root, int size, vector<K>& keys, vector<P>& payloads, Compare& comp, Projection& proj) {
+  auto less_than = [&](int a, int b) { return comp(invoke(proj, keys[start + a]), invoke(proj, keys[start + b])); };
+  while (2 * root + 1 < size) {
+    int child = 2 * root + 1;
+    if (child + 1 < size && less_than(child, child + 1)) {
+      child++;
+    }
+    if (!less_than(root, child)) {
+      return;
+    }
+    swap_rows(start + root, start + child, keys, payloads);
+    root = child;
+  }
+}
+
+template<typename K, typename P, typename Compare, typename Projection>
+void heap_sort(int start, int end, vector<K>& keys, vector<P>& payloads, Compare& comp, Projection& proj) {
+  const int size = end - start + 1;
+  for (int root = size / 2 - 1; root >= 0; root--) {
+    sift_down(start, root, size, keys, payloads, comp, proj);
+  }
+  for (int last = size - 1; last > 0; last--) {
+    swap_rows(start, start + last, keys, payloads);
+    sift_down(start, 0, last, keys, payloads, comp, proj);
+  }
+}
+
+// see sequential::sort_if_presorted()
+template<typename K, typename P, typename Compare, typename Projection>
+bool sort_if_presorted(int start, int end, vector<K>& keys, vector<P>& payloads, Compare& comp, Projection& proj) {
+  int i = start;
+  while (i < end && !comp(invoke(proj, keys[i+1]), invoke(proj, keys[i]))) {
+    i++;
+  }
+  if (i == end) {
+    return true;
+  }
+  if (i > start) {
+    return false;
+  }
+  while (i < end && !comp(invoke(proj, keys[i]), invoke(proj, keys[i+1]))) {
+    i++;
+  }
+  if (i < end) {
+    return false;
+  }
+  reverse(keys.begin() + start, keys.begin() + end + 1);
+  reverse(payloads.begin() + start, payloads.begin() + end + 1);
+  return true;
+}
+
+template<typename K, typename P, typename Compare, typename Projection>
+void introsort(int start, int end, vector<K>& keys, vector<P>& payloads, int bad_partitions_left,
+               Compare& comp, Projection& proj) {
+  if (end - start + 1 <= sequential::INSERTION_SORT_CUTOFF) {
+    insertion_sort(start, end, keys, payloads, comp, proj);
+    return;
+  }
+  if (bad_partitions_left == 0) {
+    heap_sort(start, end, keys, payloads, comp, proj);
+    return;
+  }
+  if (sort_if_presorted(start, end, keys, payloads, comp, proj)) {
+    return;
+  }
+  KeyOf<K, Projection> pivot = invoke(proj, keys[sequential::choose_pivot(start, end, keys, comp, proj)]);
+  const int split = partition_around(start, end, keys, payloads, pivot, comp, proj);
+  if (sequential::is_unbalanced(end - start + 1, split - start + 1, end - split)) {
+    bad_partitions_left--;
+    auto swap_at = [&](int a, int b) { swap_rows(a, b, keys, payloads); };
+    sequential::break_patterns_with(start, split, swap_at);
+    sequential::break_patterns_with(split + 1, end, swap_at);
+  }
+  introsort(start, split, keys, payloads, bad_partitions_left, comp, proj);
+  introsort(split + 1, end, keys, payloads, bad_partitions_left, comp, proj);
+}
+
+
+// Sorts keys by comp(proj(a), proj(b)) and moves payloads[i] wherever keys[i] goes.
+// Not stable, payloads of equal keys end up in any order.
+template<typename K, typename P, typename Compare = less<>, typename Projection = identity>
+void sort_by_key(vector<K>& keys, vector<P>& payloads, Compare comp = {}, Projection proj = {}) {
+  assert(keys.size() == payloads.size());
+  if (keys.size() < 2) {
+    return;
+  }
+  const int end = static_cast<int>(keys.size()) - 1;
+  introsort(0, end, keys, payloads, sequential::bad_partition_budget(end + 1), comp, proj);
+}
+
+// The indices of the keys in sorted order, keys[argsort(keys)[0]] is the smallest one. The keys stay as they are.
+template<typename K, typename Compare = less<>, typename Projection = identity>
+vector<uint32_t> argsort(const vector<K>& keys, Compare comp = {}, Projection proj = {}) {
+  assert(keys.size() <= numeric_limits<uint32_t>::max());
+  vector<K> sorted_keys = keys;
+  vector<uint32_t> indices(keys.size());
+  iota(indices.begin(), indices.end(), 0);
+  sort_by_key(sorted_keys, indices, comp, proj);
+  return indices;
+}
+
+}
@@ -1,50 +1,34 @@
 #include <iostream>
 #include <vector>
-#include <chrono>
-#include "sequential.hpp"
-#include "concurrent.hpp"
 #include "test.hpp"
 
 using namespace std;
 
 
-
+// The tests, built with ThreadSanitizer at -O0 by compile.sh.
+// The benchmarks are in bench.cpp (compile_bench.sh), timings of this build would be meaningless.
 int main() {
   test::test_sequential();
+  test::test_simd_partition();
+  test::test_sorting_networks();
   test::test_concurrent();
-  cout << "--------------------------------" << endl;
-
-  cout  << "Performance comparison between sequential quicksort and concurrent quicksort:" << endl;
-
-  concurrent::QuicksortWorkers workers;
-  test::RandomGenerator rand_gen;
-
-  for (int i=0; i<4; i++) {
-    vector<vector<int>> nums_batch1;
-    int nums_in_batch = 0;
-    for (int i=0; i<100; i++) {
-      const int sz = rand_gen.generate_random_number(1, 100000);
-      nums_in_batch += sz;
-      nums_batch1.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
-    }
-    vector<vector<int>> nums_batch2(nums_batch1);
-    cout << "Sorting batch #" << i << " with " << nums_in_batch << " numbers in total" << endl;
-
-    auto conc_start = chrono::high_resolution_clock::now();
-    workers.sort_batch(nums_batch1);
-    auto conc_end = chrono::high_resolution_clock::now();
-    auto conc_duration = chrono::duration_cast<chrono::milliseconds>(conc_end - conc_start);
-
-    auto seq_start = chrono::high_resolution_clock::now();
-    sequential::quicksort_sequential_batch(nums_batch2);
-    auto seq_end = chrono::high_resolution_clock::now();
-    auto seq_duration = chrono::duration_cast<chrono::milliseconds>(seq_end - seq_start);
-
-    cout << "Sorting completed by sequential quicksort in " << seq_duration.count() << " ms" << endl;
-    cout << "Sorting completed by concurrent quicksort with " << workers.number_of_workers() << " workers in " << conc_duration.count() << " ms" << endl;
-  }
-
-  workers.kill_workers();
+  test::test_concurrent_worker_counts();
+  test::test_concurrent_grain_sizes();
+  test::test_concurrent_single_vector();
+  test::test_concurrent_callers_stress();
+  test::test_concurrent_placement();
+  test::test_radix();
+  test::test_merge();
+  test::test_external_sort();
+  test::test_concurrent_overlapping_batches();
+  test::test_concurrent_selection();
+  test::test_concurrent_cancellation();
+  test::test_concurrent_clients();
+  test::test_generic();
+  test::test_key_value();
+  test::test_quadratic_killers();
+  test::test_concurrent_stats();
+  test::test_concurrent_no_allocations();
 
   return 0;
 }
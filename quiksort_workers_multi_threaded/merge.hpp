@@ -0,0 +1,166 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include "sequential.hpp"
+
+// Merging k sorted runs into one sorted output.
+// The building blocks are shared with QuicksortWorkers::merge_batch() in concurrent.hpp,
+// which cuts the output into slices with co_rank() and merges the slices on all the workers.
+namespace merge {
+
+using namespace std;
+
+
+// The runs are anything indexable holding sorted ranges, e.g. a vector of vectors or of spans.
+
+
+// Finds where output position k falls in every run:
+// positions[r] numbers of runs[r] come before position k of the merged output, sum(positions) == k.
+//
+// Equal keys are ordered by run and then by index, which makes the order strict
+// so that every k has exactly one answer and neighbouring slices neither overlap nor leave gaps.
+// Works like a binary search on all the runs at once: the middle of the widest remaining window is taken as pivot,
+// every run is cut at the pivot (one more binary search each), and depending on whether more or less than k numbers
+// come before it the windows shrink from below or from above. The widest window halves every round.
+template<typename Runs, typename Compare = less<>, typename Projection = identity>
+void co_rank(const Runs& runs, const size_t k, vector<int>& positions, Compare comp = {}, Projection proj = {}) {
+  const int num_runs = runs.size();
+  // the cut of run r is somewhere in [lo[r], hi[r]]
+  vector<int> lo(num_runs, 0);
+  vector<int> hi(num_runs);
+  for (int r=0; r < num_runs; r++) {
+    hi[r] = runs[r].size();
+  }
+  positions.resize(num_runs);
+  while (true) {
+    int widest = 0;
+    for (int r=1; r < num_runs; r++) {
+      if (hi[r] - lo[r] > hi[widest] - lo[widest]) {
+        widest = r;
+      }
+    }
+    if (num_runs == 0 || hi[widest] == lo[widest]) {
+      // every window is closed, the cuts are exact
+      positions = lo;
+      return;
+    }
+    const int mid = lo[widest] + (hi[widest] - lo[widest]) / 2;
+    const auto& pivot = invoke(proj, runs[widest][mid]);
+    // how many numbers of every run come before the pivot
+    size_t before = 0;
+    for (int r=0; r < num_runs; r++) {
+      const auto first = runs[r].begin() + lo[r];
+      const auto last = runs[r].begin() + hi[r];
+      if (r == widest) {
+        positions[r] = mid;
+      } else if (r < widest) {
+        // equal keys of earlier runs come first
+        positions[r] = upper_bound(first, last, pivot, [&](const auto& key, const auto& num) {
+          return comp(key, invoke(proj, num));
+        }) - runs[r].begin();
+      } else {
+        positions[r] = lower_bound(first, last, pivot, [&](const auto& num, const auto& key) {
+          return comp(invoke(proj, num), key);
+        }) - runs[r].begin();
+      }
+      before += positions[r];
+    }
+    if (before == k) {
+      return;
+    }
+    if (before < k) {
+      // the pivot and everything before it are in the first k
+      for (int r=0; r < num_runs; r++) {
+        lo[r] = positions[r];
+      }
+      lo[widest] = mid + 1;
+    } else {
+      for (int r=0; r < num_runs; r++) {
+        hi[r] = positions[r];
+      }
+    }
+  }
+}
+
+
+// Merges runs[r][from[r] .. to[r]) of every run into out, which must have room for all of them.
+//
+// A loser tree (tournament): the leaves are the runs, every inner node remembers the loser of the match below it
+// and tree[0] the overall winner, i.e. the run with the smallest front number. After taking a number from it
+// only the matches on the path from its leaf to the root are replayed, log2(k) comparisons and no sifting
+// around like in a binary heap. Ties go to the earlier run (matching co_rank()).
+template<typename Runs, typename T, typename Compare = less<>, typename Projection = identity>
+void merge_slices(const Runs& runs, const vector<int>& from, const vector<int>& to, T* out,
+                  Compare comp = {}, Projection proj = {}) {
+  const int num_runs = runs.size();
+  // the front of every run and its end, a finished run has next == stop and loses every match.
+  // One more empty run fills up the leaves when the number of runs isn't a power of 2.
+  vector<const T*> next(num_runs + 1, nullptr);
+  vector<const T*> stop(num_runs + 1, nullptr);
+  for (int r=0; r < num_runs; r++) {
+    next[r] = runs[r].data() + from[r];
+    stop[r] = runs[r].data() + to[r];
+  }
+  auto beats = [&](int a, int b) {
+    if (next[a] == stop[a]) {
+      return false;
+    }
+    if (next[b] == stop[b]) {
+      return true;
+    }
+    if (comp(invoke(proj, *next[a]), invoke(proj, *next[b]))) {
+      return true;
+    }
+    return !comp(invoke(proj, *next[b]), invoke(proj, *next[a])) && a < b;
+  };
+
+  int leaves = 1;
+  while (leaves < num_runs) {
+    leaves *= 2;
+  }
+  vector<int> tree(leaves, num_runs);
+  // winners of the matches on the current level, built bottom up
+  vector<int> winners(leaves);
+  for (int i=0; i < leaves; i++) {
+    winners[i] = min(i, num_runs);
+  }
+  for (int level_size = leaves; level_size > 1; level_size /= 2) {
+    for (int i=0; i < level_size / 2; i++) {
+      const int a = winners[2 * i];
+      const int b = winners[2 * i + 1];
+      // the node of this match is level_size / 2 + i
+      tree[level_size / 2 + i] = beats(b, a) ? a : b;
+      winners[i] = beats(b, a) ? b : a;
+    }
+  }
+  int winner = winners[0];
+
+  while (next[winner] != stop[winner]) {
+    *out++ = *next[winner]++;
+    for (int node = (leaves + winner) / 2; node >= 1; node /= 2) {
+      if (beats(tree[node], winner)) {
+        std::swap(tree[node], winner);
+      }
+    }
+  }
+}
+
+
+// The single threaded merge, all the runs into one vector
+template<typename T, typename Compare = less<>, typename Projection = identity>
+void merge_sequential(const vector<vector<T>>& runs, vector<T>& out, Compare comp = {}, Projection proj = {}) {
+  size_t total = 0;
+  vector<int> from(runs.size(), 0);
+  vector<int> to(runs.size());
+  for (size_t r=0; r < runs.size(); r++) {
+    to[r] = runs[r].size();
+    total += runs[r].size();
+  }
+  out.resize(total);
+  merge_slices(runs, from, to, out.data(), comp, proj);
+}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include "sequential.hpp"
+
+// LSD radix sort for ints, one byte per pass.
+// The building blocks (counting and scattering a chunk of numbers) are shared with
+// the concurrent engine in concurrent.hpp, which runs them over the chunks of a vector on all the workers.
+namespace radix {
+
+using namespace std;
+
+constexpr int RADIX_BITS = 8;
+constexpr int BUCKETS = 1 << RADIX_BITS;
+constexpr int PASSES = 32 / RADIX_BITS;
+// one cache line worth of ints per bucket in the write combining buffers
+constexpr int WC_BUFFER_INTS = 64 / sizeof(int);
+
+using Histogram = array<int, BUCKETS>;
+
+
+uint32_t digit(int num, int pass) {
+  // flipping the sign bit makes the negative numbers come before the positive ones
+  return ((static_cast<uint32_t>(num) ^ 0x80000000u) >> (pass * RADIX_BITS)) & (BUCKETS - 1);
+}
+
+void count_digits(const int* nums, int n, int pass, Histogram& hist) {
+  hist.fill(0);
+  for (int i=0; i<n; i++) {
+    hist[digit(nums[i], pass)]++;
+  }
+}
+
+// Software write combining.
+// Writing every number straight to its bucket touches up to 256 different cache lines in a row,
+// way more than the cpu can keep open, so most of the writes end up as read-for-ownership misses.
+// Instead the numbers are collected in a small cache line sized buffer per bucket
+// and only full buffers are copied out, i.e. one 64 byte write instead of 16 scattered ones.
+struct ScatterBuffers {
+  alignas(64) int data[BUCKETS][WC_BUFFER_INTS];
+  int fill[BUCKETS];
+};
+
+// offsets: where the next number of every bucket goes in `to`, advanced as the numbers get written
+void scatter(const int* from, int n, int pass, Histogram& offsets, int* to) {
+  // 16KB, too big for the stack of every call, one per thread is enough
+  static thread_local ScatterBuffers buffers;
+  memset(buffers.fill, 0, sizeof(buffers.fill));
+  for (int i=0; i<n; i++) {
+    const uint32_t d = digit(from[i], pass);
+    buffers.data[d][buffers.fill[d]++] = from[i];
+    if (buffers.fill[d] == WC_BUFFER_INTS) {
+      memcpy(to + offsets[d], buffers.data[d], sizeof(buffers.data[d]));
+      offsets[d] += WC_BUFFER_INTS;
+      buffers.fill[d] = 0;
+    }
+  }
+  for (int d=0; d<BUCKETS; d++) {
+    memcpy(to + offsets[d], buffers.data[d], buffers.fill[d] * sizeof(int));
+    offsets[d] += buffers.fill[d];
+  }
+}
+
+// A pass where every number has the same digit wouldn't move anything, e.g. the upper bytes of small numbers
+bool pass_is_noop(const Histogram& hist, int n) {
+  for (int count: hist) {
+    if (count == n) {
+      return true;
+    }
+    if (count != 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
+void radix_sort(vector<int>& nums, vector<int>& temp) {
+  const int n = nums.size();
+  if (n <= sequential::INSERTION_SORT_CUTOFF) {
+    if (n > 1) {
+      sequential::insertion_sort(0, n - 1, nums);
+    }
+    return;
+  }
+  temp.resize(n);
+  int* from = nums.data();
+  int* to = temp.data();
+  for (int pass=0; pass < PASSES; pass++) {
+    Histogram hist;
+    count_digits(from, n, pass, hist);
+    if (pass_is_noop(hist, n)) {
+      continue;
+    }
+    // exclusive prefix sum: first position of every bucket
+    Histogram offsets;
+    int sum = 0;
+    for (int d=0; d<BUCKETS; d++) {
+      offsets[d] = sum;
+      sum += hist[d];
+    }
+    scatter(from, n, pass, offsets, to);
+    std::swap(from, to);
+  }
+  if (from != nums.data()) {
+    memcpy(nums.data(), from, n * sizeof(int));
+  }
+}
+
+void radix_sort_sequential_batch(vector<vector<int>>& nums_batch) {
+  vector<int> temp;
+  for (auto& nums: nums_batch) {
+    radix_sort(nums, temp);
+  }
+}
+
+}
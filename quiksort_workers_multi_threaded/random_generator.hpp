@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <random>
+
+// Random numbers for the tests and the benchmarks
+namespace test {
+
+using namespace std;
+
+class RandomGenerator {
+public:
+  RandomGenerator() {
+    auto random_seed = rand_dev();
+    rand_eng = default_random_engine(random_seed);
+  }
+  int generate_random_number(int min_val, int max_val) {
+    uniform_int_distribution<int> rand_distrb(min_val, max_val);
+    return rand_distrb(rand_eng);
+  }
+  vector<int> generate_random_vector(int size, int min_val, int max_val) {
+    vector<int> nums;
+    while (size--) {
+      nums.push_back(generate_random_number(min_val, max_val));
+    }
+    return nums;
+  }
+private:
+  // Note:
+  // Random device is internally a: /dev/urandom
+  // Unlike /dev/random which waits for sufficient entropy
+  // /dev/urandom doesn't wait and return immediately.
+  // The device is locked and serially served on multiple calls.
+  // The random events such as network, mouse interrupts, etc. are used to fill in the entropy pool
+  //
+  // Example:
+  // head -c 8 /dev/urandom 
+  // read the first 8 bytes from the file i.e random device
+  random_device rand_dev;
+  // we can use this true random source as a seed into pseduo random number generator engines.
+  // The sequence of bytes generated by such engine can then be used as a random number.
+  // With such engines we have more control over the distribution.
+  // Also we won't need open() & read() system calls to read from the kernel random source
+  default_random_engine rand_eng;
+};
+
+} // namespace test
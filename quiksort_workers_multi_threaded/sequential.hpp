@@ -1,37 +1,82 @@
-#pragma once 
+#pragma once
 
 #include <iostream>
 #include <cassert>
 #include <vector>
 #include <random>
+#include <functional>
+#include <type_traits>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include "simd_partition.hpp"
+#include "sorting_network.hpp"
 
 namespace sequential {
 
 using namespace std;
 
-void swap(int a, int b, vector<int>& nums);
+// The sort orders the elements by comp(proj(a), proj(b)).
+// The projection picks the key to sort by, e.g. a member of a struct, so the elements don't have to
+// be copied into a vector of keys first. With the defaults (less<>, identity) it is plain `a < b`
+// and the compiler generates the same code as for the int only version.
+template<typename T, typename Projection>
+using KeyOf = remove_cvref_t<invoke_result_t<Projection&, const T&>>;
 
-void quicksort_sequential(int start, int end, vector<int>& nums);
+template<typename T>
+void swap(int a, int b, vector<T>& nums);
 
-void quicksort_sequential_batch(vector<vector<int>>& nums_batch) {
-  for (auto& nums: nums_batch) {
-    quicksort_sequential(0, nums.size() - 1, nums);
+template<typename T, typename Compare = less<>, typename Projection = identity>
+void quicksort_sequential(int start, int end, vector<T>& nums, Compare comp = {}, Projection proj = {});
+
+// below this many numbers partitioning costs more than it saves
+constexpr int INSERTION_SORT_CUTOFF = 16;
+
+// from this many numbers on the pivot is the median of 9 samples instead of 3
+constexpr int NINTHER_THRESHOLD = 128;
+
+template<typename T, typename Compare = less<>, typename Projection = identity>
+void insertion_sort(int start, int end, vector<T>& nums, Compare comp = {}, Projection proj = {}) {
+  for (int i=start+1; i <= end; i++) {
+    if constexpr (is_trivially_copyable_v<T>) {
+      // find the spot first and then shift the whole stretch with one memmove
+      // instead of moving the elements one by one
+      int j = i;
+      while (j > start && comp(invoke(proj, nums[i]), invoke(proj, nums[j-1]))) {
+        j--;
+      }
+      if (j < i) {
+        T num = nums[i];
+        memmove(&nums[j+1], &nums[j], (i - j) * sizeof(T));
+        nums[j] = num;
+      }
+    } else {
+      T num = move(nums[i]);
+      int j = i - 1;
+      while (j >= start && comp(invoke(proj, num), invoke(proj, nums[j]))) {
+        nums[j+1] = move(nums[j]);
+        j--;
+      }
+      nums[j+1] = move(num);
+    }
   }
 }
 
-void quicksort_sequential(int start, int end, vector<int>& nums) {
-  assert(start <= end);
-  if (start == end) {
-    return;
-  }
-  if (start + 1 == end) {
-    if (nums[end] < nums[start]) {
-      swap(start, end, nums);
+// 3 way partition of [start, end] around pivot (Dutch national flag).
+// Returns {l, r}: left of l is strictly smaller than pivot, right of r strictly greater, [l, r] equal.
+// Plain ints go through the AVX2 kernel when the cpu has it, see simd_partition.hpp.
+template<typename T, typename Compare = less<>, typename Projection = identity>
+pair<int, int> partition_around(int start, int end, vector<T>& nums, const KeyOf<T, Projection>& pivot,
+                                Compare comp = {}, Projection proj = {}) {
+  if constexpr (simd::kernels_apply<T, Compare, Projection>) {
+    if (end - start + 1 >= simd::MIN_PARTITION_SIZE && simd::avx2_enabled()) {
+      int* first = nums.data();
+      auto [less_end, equal_end] = simd::partition3_avx2(first + start, first + end + 1, pivot);
+      return {static_cast<int>(less_end - first), static_cast<int>(equal_end - first) - 1};
     }
-    return;
   }
-  int pivot = nums[(start + end) / 2];
-
   // invariant:
   // left of l is strictly smaller than pivot
   // right or r is strictly greater than pivot
@@ -40,25 +85,183 @@ void quicksort_sequential(int start, int end, vector<int>& nums) {
 
   int i = l;
   while (i <= r) {
-    if (nums[i] < pivot) {
+    if (comp(invoke(proj, nums[i]), pivot)) {
       swap(i, l, nums);
       l++; i++;
-    } else if (nums[i] > pivot) {
+    } else if (comp(pivot, invoke(proj, nums[i]))) {
       swap(i, r, nums);
       r--;
     } else {
       i++;
     }
   }
-  quicksort_sequential(start, max(l-1, start), nums);
-  quicksort_sequential(min(r+1, end), end, nums);
+  return {l, r};
+}
+
+// Guarding the quicksort against inputs which make it quadratic.
+//
+// The middle number as the pivot is fine on random data, but structured data (organ pipes, sawtooths)
+// or an input crafted against it leaves one side of every partition (nearly) empty, that's O(n^2).
+// 1. The pivot is the median of 3 samples (first, middle, last) or for bigger ranges
+//    the median of the medians of 3 triples spread over the range (Tukey's ninther).
+// 2. A partition which leaves more than 7/8 of the numbers on one side is a bad one.
+//    After a bad partition a few numbers are swapped around (break_patterns()) so that the next samples differ,
+//    and every range gets a budget of log2(n) bad partitions. A range which runs out of it is heapsorted,
+//    which bounds the whole sort to O(n log n) whatever the input.
+// 3. A range which is already sorted (or sorted the other way around) is left alone (or reversed) without
+//    partitioning it. The check gives up at the first two numbers out of order both ways, on random data right away.
+
+// how many bad partitions a range of n numbers may go through before it is heapsorted
+int bad_partition_budget(const int n) {
+  return bit_width(static_cast<unsigned>(max(n, 1)));
+}
+
+// [less | equal | greater] with more than 7/8 of the n numbers in less or greater
+bool is_unbalanced(const int n, const int less_size, const int greater_size) {
+  return max(less_size, greater_size) > n - n / 8;
+}
+
+// index of the median of nums[a], nums[b] and nums[c]
+template<typename T, typename Compare, typename Projection>
+int median_of_3(const int a, const int b, const int c, const vector<T>& nums, Compare& comp, Projection& proj) {
+  auto less_than = [&](int x, int y) { return comp(invoke(proj, nums[x]), invoke(proj, nums[y])); };
+  if (less_than(a, b)) {
+    if (less_than(b, c)) {
+      return b;
+    }
+    return less_than(a, c) ? c : a;
+  }
+  if (less_than(a, c)) {
+    return a;
+  }
+  return less_than(b, c) ? c : b;
 }
 
+// the index of the pivot for [start, end], at least 3 numbers
+template<typename T, typename Compare = less<>, typename Projection = identity>
+int choose_pivot(const int start, const int end, const vector<T>& nums, Compare comp = {}, Projection proj = {}) {
+  const int n = end - start + 1;
+  const int mid = start + n / 2;
+  if (n < NINTHER_THRESHOLD) {
+    return median_of_3(start, mid, end, nums, comp, proj);
+  }
+  // 9 samples evenly spread over the range
+  const int step = n / 8;
+  return median_of_3(median_of_3(start, start + step, start + 2 * step, nums, comp, proj),
+                     median_of_3(mid - step, mid, mid + step, nums, comp, proj),
+                     median_of_3(end - 2 * step, end - step, end, nums, comp, proj), nums, comp, proj);
+}
+
+// Swaps the numbers at the spots choose_pivot() samples with numbers from elsewhere in the range,
+// swap_at(a, b) does the swapping
+template<typename SwapAt>
+void break_patterns_with(const int start, const int end, SwapAt swap_at) {
+  const int n = end - start + 1;
+  if (n < 8) {
+    return;
+  }
+  // xorshift, seeded with the size so that the same input is always sorted the same way
+  uint32_t state = static_cast<uint32_t>(n) * 2654435761u | 1;
+  for (int k=0; k <= 8; k++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    swap_at(start + static_cast<int>(static_cast<int64_t>(n - 1) * k / 8), start + static_cast<int>(state % n));
+  }
+}
+
+template<typename T>
+void break_patterns(const int start, const int end, vector<T>& nums) {
+  break_patterns_with(start, end, [&](int a, int b) { swap(a, b, nums); });
+}
 
-void swap(int a, int b, vector<int>& nums) {
-  int temp = nums[a];
-  nums[a] = nums[b];
-  nums[b] = temp;
+template<typename T, typename Compare = less<>, typename Projection = identity>
+void heap_sort(const int start, const int end, vector<T>& nums, Compare comp = {}, Projection proj = {}) {
+  auto less_than = [&](const T& a, const T& b) { return comp(invoke(proj, a), invoke(proj, b)); };
+  make_heap(nums.begin() + start, nums.begin() + end + 1, less_than);
+  sort_heap(nums.begin() + start, nums.begin() + end + 1, less_than);
+}
+
+// Returns true if [start, end] was sorted already or the other way around, then it got reversed.
+template<typename T, typename Compare = less<>, typename Projection = identity>
+bool sort_if_presorted(const int start, const int end, vector<T>& nums, Compare comp = {}, Projection proj = {}) {
+  int i = start;
+  while (i < end && !comp(invoke(proj, nums[i+1]), invoke(proj, nums[i]))) {
+    i++;
+  }
+  if (i == end) {
+    return true;
+  }
+  if (i > start) {
+    return false;
+  }
+  while (i < end && !comp(invoke(proj, nums[i]), invoke(proj, nums[i+1]))) {
+    i++;
+  }
+  if (i < end) {
+    return false;
+  }
+  reverse(nums.begin() + start, nums.begin() + end + 1);
+  return true;
+}
+
+template<typename T, typename Compare = less<>, typename Projection = identity>
+void quicksort_sequential_batch(vector<vector<T>>& nums_batch, Compare comp = {}, Projection proj = {}) {
+  for (auto& nums: nums_batch) {
+    quicksort_sequential(0, nums.size() - 1, nums, comp, proj);
+  }
+}
+
+// quicksort_sequential() with the bad partitions [start, end] may still go through
+template<typename T, typename Compare, typename Projection>
+void introsort(int start, int end, vector<T>& nums, int bad_partitions_left, Compare comp, Projection proj) {
+  if constexpr (simd::kernels_apply<T, Compare, Projection>) {
+    // the leaves of plain ints go to the sorting networks, see sorting_network.hpp
+    if (end - start + 1 <= simd::SORTING_NETWORK_MAX_SIZE && simd::avx2_enabled()) {
+      simd::sort_small_avx2(nums.data() + start, end - start + 1);
+      return;
+    }
+  }
+  if (end - start + 1 <= INSERTION_SORT_CUTOFF) {
+    insertion_sort(start, end, nums, comp, proj);
+    return;
+  }
+  if (bad_partitions_left == 0) {
+    heap_sort(start, end, nums, comp, proj);
+    return;
+  }
+  if (sort_if_presorted(start, end, nums, comp, proj)) {
+    return;
+  }
+  // a copy of the key, the element it came from is going to be moved around
+  KeyOf<T, Projection> pivot = invoke(proj, nums[choose_pivot(start, end, nums, comp, proj)]);
+  auto [l, r] = partition_around(start, end, nums, pivot, comp, proj);
+  if (is_unbalanced(end - start + 1, l - start, end - r)) {
+    bad_partitions_left--;
+    break_patterns(start, l - 1, nums);
+    break_patterns(r + 1, end, nums);
+  }
+  introsort(start, max(l-1, start), nums, bad_partitions_left, comp, proj);
+  introsort(min(r+1, end), end, nums, bad_partitions_left, comp, proj);
+}
+
+template<typename T, typename Compare, typename Projection>
+void quicksort_sequential(int start, int end, vector<T>& nums, Compare comp, Projection proj) {
+  assert(start <= end);
+  introsort(start, end, nums, bad_partition_budget(end - start + 1), comp, proj);
+}
+
+
+template<typename T>
+void swap(int a, int b, vector<T>& nums) {
+  if constexpr (is_trivially_copyable_v<T>) {
+    T temp = nums[a];
+    nums[a] = nums[b];
+    nums[b] = temp;
+  } else {
+    // e.g. strings, swapping their guts is way cheaper than copying them
+    std::swap(nums[a], nums[b]);
+  }
 }
 
 }
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_PARTITION_X86 1
+#endif
+
+// Branchless AVX2 partitioning of ints, 8 at a time.
+// The scalar Dutch flag loop does a compare and (most of the time) a swap per number,
+// and on random input the branch predictor guesses wrong on every other one.
+// Here a whole vector is compared against the pivot at once, the comparison mask picks a permutation
+// which moves the smaller numbers to the front of the vector and the rest to the back,
+// and the permuted vector is stored on both ends of the range. No branch depends on the numbers.
+//
+// The kernels are compiled for AVX2 with a target attribute, so the rest of the program doesn't need -mavx2,
+// and are only called after checking the cpu supports it.
+namespace simd {
+
+using namespace std;
+
+
+// below this the scalar loop is as fast and the kernel needs 16 numbers to get going anyway
+constexpr int MIN_PARTITION_SIZE = 64;
+
+// the kernels only know how to order plain ints ascending
+template<typename T, typename Compare, typename Projection>
+constexpr bool kernels_apply =
+  is_same_v<T, int> && (is_same_v<Compare, less<>> || is_same_v<Compare, less<int>>) && is_same_v<Projection, identity>;
+
+
+bool cpu_supports_avx2() {
+#ifdef SIMD_PARTITION_X86
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+atomic<bool>& avx2_switch() {
+  static atomic<bool> enabled = cpu_supports_avx2();
+  return enabled;
+}
+
+bool avx2_enabled() {
+  return avx2_switch().load(memory_order_relaxed);
+}
+
+// e.g. to compare against the scalar loop, turning it on is ignored if the cpu can't do AVX2
+void set_avx2_enabled(bool enabled) {
+  avx2_switch() = enabled && cpu_supports_avx2();
+}
+
+
+// For every 8 bit comparison mask the lane order which puts the lanes with their bit set first (in order)
+// followed by the others. 8KB, fits in L1 next to the numbers.
+struct PartitionTable {
+  alignas(32) int32_t lanes[256][8];
+};
+
+constexpr PartitionTable make_partition_table() {
+  PartitionTable table{};
+  for (int mask=0; mask < 256; mask++) {
+    int k = 0;
+    for (int lane=0; lane < 8; lane++) {
+      if (mask >> lane & 1) {
+        table.lanes[mask][k++] = lane;
+      }
+    }
+    for (int lane=0; lane < 8; lane++) {
+      if (!(mask >> lane & 1)) {
+        table.lanes[mask][k++] = lane;
+      }
+    }
+  }
+  return table;
+}
+
+constexpr PartitionTable PARTITION_TABLE = make_partition_table();
+
+
+#ifdef SIMD_PARTITION_X86
+
+// Moves the numbers < bound of [first, last) to the front, returns where the rest starts.
+//
+// In place with the trick from vxsort: the first and the last vector are put aside which leaves
+// 16 free slots, and every vector read frees 8 more on its side. Reading from the side with less free space
+// guarantees that both stores (8 lanes each, only the front/back part of them is kept) land in free slots.
+__attribute__((target("avx2")))
+int* partition_less_avx2(int* first, int* last, const int bound) {
+  if (last - first < 16) {
+    int* write = first;
+    for (int* p = first; p < last; p++) {
+      if (*p < bound) {
+        std::swap(*p, *write);
+        write++;
+      }
+    }
+    return write;
+  }
+  const __m256i bound_v = _mm256_set1_epi32(bound);
+  const __m256i saved_left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+  const __m256i saved_right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(last - 8));
+  int* read_left = first + 8;
+  int* read_right = last - 8;
+  int* write_left = first;
+  int* write_right = last;
+
+  while (read_right - read_left >= 8) {
+    __m256i v;
+    if (read_left - write_left <= write_right - read_right) {
+      v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(read_left));
+      read_left += 8;
+    } else {
+      read_right -= 8;
+      v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(read_right));
+    }
+    const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(bound_v, v)));
+    const __m256i lanes = _mm256_load_si256(reinterpret_cast<const __m256i*>(PARTITION_TABLE.lanes[mask]));
+    const __m256i partitioned = _mm256_permutevar8x32_epi32(v, lanes);
+    const int num_less = __builtin_popcount(mask);
+    // the smaller ones are the front of the vector, the rest its back
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(write_left), partitioned);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(write_right - 8), partitioned);
+    write_left += num_less;
+    write_right -= 8 - num_less;
+  }
+
+  // the last few unread numbers and the two vectors put aside fill the gap that's left exactly
+  alignas(32) int rest[24];
+  const int num_unread = read_right - read_left;
+  for (int i=0; i < num_unread; i++) {
+    rest[i] = read_left[i];
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(rest + num_unread), saved_left);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(rest + num_unread + 8), saved_right);
+  for (int i=0; i < num_unread + 16; i++) {
+    if (rest[i] < bound) {
+      *write_left++ = rest[i];
+    } else {
+      *--write_right = rest[i];
+    }
+  }
+  return write_left;
+}
+
+// 3 way partition of [first, last) around pivot as two 2 way passes,
+// the second one only over the numbers >= pivot.
+// Returns where the numbers equal to the pivot start and end.
+__attribute__((target("avx2")))
+pair<int*, int*> partition3_avx2(int* first, int* last, const int pivot) {
+  int* less_end = partition_less_avx2(first, last, pivot);
+  int* equal_end = pivot == numeric_limits<int>::max() ? last : partition_less_avx2(less_end, last, pivot + 1);
+  return {less_end, equal_end};
+}
+
+#else
+// never called, avx2_enabled() is always false here
+pair<int*, int*> partition3_avx2(int* first, int* last, const int pivot) {
+  (void) pivot;
+  return {first, last};
+}
+#endif
+
+}
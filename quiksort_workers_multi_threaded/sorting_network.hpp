@@ -0,0 +1,143 @@
+#pragma once
+
+#include <climits>
+#include <cstring>
+#include "simd_partition.hpp"
+
+// Bitonic sorting networks in AVX2 registers for the leaves of the quicksort, up to 64 ints.
+// Insertion sort on a leaf of n numbers does ~n^2/4 compares and mispredicts on most of them,
+// a network does a fixed sequence of vector min/max and shuffles without a single data dependent branch.
+//
+// The leaf is padded with INT_MAX to the next size class (8, 16, 32 or 64 numbers, i.e. 1, 2, 4 or 8 registers)
+// and every size class is its own instantiation, so the whole network is unrolled at compile time.
+// Uses the same cpu check and switch as the partition kernel, see simd_partition.hpp.
+namespace simd {
+
+using namespace std;
+
+
+constexpr int SORTING_NETWORK_MAX_SIZE = 64;
+
+
+#ifdef SIMD_PARTITION_X86
+
+// lanes whose bit is set in max_lanes take the max of v and its shuffled partner, the others the min
+template<int max_lanes>
+__attribute__((target("avx2"), always_inline))
+inline __m256i compare_lanes(__m256i v, __m256i partner) {
+  return _mm256_blend_epi32(_mm256_min_epi32(v, partner), _mm256_max_epi32(v, partner), max_lanes);
+}
+
+__attribute__((target("avx2"), always_inline))
+inline __m256i reverse_lanes(__m256i v) {
+  return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+// sorts a register which is bitonic (goes up then down, or the other way around)
+// with the half cleaners at distance 4, 2 and 1
+__attribute__((target("avx2"), always_inline))
+inline __m256i bitonic_clean(__m256i v) {
+  v = compare_lanes<0xF0>(v, _mm256_permute2x128_si256(v, v, 1));
+  v = compare_lanes<0xCC>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = compare_lanes<0xAA>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return v;
+}
+
+// Sorts the 8 lanes of one register.
+// Sorted runs of 2 and 4 are merged by comparing every lane with its mirror in the run twice as long
+// (which leaves two bitonic halves, everything in the lower half <= everything in the upper one)
+// followed by the half cleaners.
+__attribute__((target("avx2"), always_inline))
+inline __m256i sort_register(__m256i v) {
+  v = compare_lanes<0xAA>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  v = compare_lanes<0xCC>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+  v = compare_lanes<0xAA>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  v = compare_lanes<0xF0>(v, reverse_lanes(v));
+  v = compare_lanes<0xCC>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = compare_lanes<0xAA>(v, _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return v;
+}
+
+__attribute__((target("avx2"), always_inline))
+inline void compare_registers(__m256i& low, __m256i& high) {
+  const __m256i min_v = _mm256_min_epi32(low, high);
+  high = _mm256_max_epi32(low, high);
+  low = min_v;
+}
+
+// Sorts the 8 * NUM_REGISTERS numbers in regs, the same scheme one level up:
+// sorted runs of 1, 2, 4 registers are merged by comparing against the mirrored other run,
+// then cleaned across the registers and finally within every register.
+template<int NUM_REGISTERS>
+__attribute__((target("avx2"), always_inline))
+inline void sort_registers(__m256i* regs) {
+  for (int i=0; i < NUM_REGISTERS; i++) {
+    regs[i] = sort_register(regs[i]);
+  }
+  for (int width = 1; width < NUM_REGISTERS; width *= 2) {
+    for (int group = 0; group < NUM_REGISTERS; group += 2 * width) {
+      // lane j of register i in the lower run against the mirrored lane of the mirrored register in the upper run
+      for (int i=0; i < width; i++) {
+        __m256i& low = regs[group + i];
+        __m256i& high = regs[group + 2 * width - 1 - i];
+        const __m256i high_reversed = reverse_lanes(high);
+        const __m256i min_v = _mm256_min_epi32(low, high_reversed);
+        high = reverse_lanes(_mm256_max_epi32(low, high_reversed));
+        low = min_v;
+      }
+      for (int distance = width / 2; distance >= 1; distance /= 2) {
+        for (int i = group; i < group + 2 * width; i++) {
+          if (((i - group) & distance) == 0) {
+            compare_registers(regs[i], regs[i + distance]);
+          }
+        }
+      }
+      for (int i = group; i < group + 2 * width; i++) {
+        regs[i] = bitonic_clean(regs[i]);
+      }
+    }
+  }
+}
+
+template<int NUM_REGISTERS>
+__attribute__((target("avx2")))
+void sort_size_class(int* nums, const int n) {
+  alignas(32) int padded[NUM_REGISTERS * 8];
+  memcpy(padded, nums, n * sizeof(int));
+  // the padding sorts to the end and is cut off again
+  for (int i = n; i < NUM_REGISTERS * 8; i++) {
+    padded[i] = INT_MAX;
+  }
+  __m256i regs[NUM_REGISTERS];
+  for (int i=0; i < NUM_REGISTERS; i++) {
+    regs[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(padded + 8 * i));
+  }
+  sort_registers<NUM_REGISTERS>(regs);
+  for (int i=0; i < NUM_REGISTERS; i++) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(padded + 8 * i), regs[i]);
+  }
+  memcpy(nums, padded, n * sizeof(int));
+}
+
+// sorts nums[0 .. n), n <= SORTING_NETWORK_MAX_SIZE
+void sort_small_avx2(int* nums, const int n) {
+  if (n <= 8) {
+    sort_size_class<1>(nums, n);
+  } else if (n <= 16) {
+    sort_size_class<2>(nums, n);
+  } else if (n <= 32) {
+    sort_size_class<4>(nums, n);
+  } else {
+    sort_size_class<8>(nums, n);
+  }
+}
+
+#else
+// never called, avx2_enabled() is always false here
+void sort_small_avx2(int* nums, const int n) {
+  (void) nums;
+  (void) n;
+}
+#endif
+
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <algorithm>
+
+// Per-worker counters and an optional timeline of QuicksortWorkers, to tell whether a slow batch
+// comes from lock contention, idle workers or one worker doing all the work.
+//
+// The counters are cheap (every worker only writes its own, on its own cache line, no atomic read-modify-write)
+// but not free. Compile with -DQUICKSORT_WORKERS_STATS=0 and every counting line disappears.
+#ifndef QUICKSORT_WORKERS_STATS
+#define QUICKSORT_WORKERS_STATS 1
+#endif
+
+namespace stats {
+
+using namespace std;
+
+
+constexpr bool ENABLED = QUICKSORT_WORKERS_STATS;
+
+uint64_t now_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Written by one thread at a time (its worker, or whoever holds the lock it is guarded by), read by anybody.
+// A relaxed load + store instead of fetch_add, there is no other writer to race with.
+struct Counter {
+  atomic<uint64_t> value = 0;
+
+  void add(uint64_t n) {
+    if constexpr (ENABLED) {
+      value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+  }
+
+  void raise_to(uint64_t n) {
+    if constexpr (ENABLED) {
+      if (n > value.load(memory_order_relaxed)) {
+        value.store(n, memory_order_relaxed);
+      }
+    }
+  }
+
+  uint64_t get() const {
+    return value.load(memory_order_relaxed);
+  }
+};
+
+// the live counters of one worker, a cache line (or two) of its own so the workers don't false share
+struct alignas(64) WorkerCounters {
+  // sorting (or radix sorting) tasks and helper tasks of parallel_for()
+  Counter tasks_executed;
+  Counter helper_tasks;
+  // numbers in the ranges sort_task() partitioned, a number counts once per level of the recursion.
+  // The leaves handed to sequential::quicksort_sequential() (see Grain::sequential_cutoff) don't count
+  Counter elements_partitioned;
+  // running tasks / looking for a task before parking / parked
+  Counter busy_ns;
+  Counter spin_ns;
+  Counter parked_ns;
+  // only acquisitions of a queue mutex which had to wait are timed, the uncontended ones cost nothing extra
+  Counter lock_contentions;
+  Counter lock_wait_ns;
+  Counter steals;
+  Counter failed_steals;
+};
+
+// The counters of one worker at one point in time
+struct WorkerStats {
+  uint64_t tasks_executed = 0;
+  uint64_t helper_tasks = 0;
+  uint64_t elements_partitioned = 0;
+  uint64_t busy_ns = 0;
+  uint64_t spin_ns = 0;
+  uint64_t parked_ns = 0;
+  uint64_t lock_contentions = 0;
+  uint64_t lock_wait_ns = 0;
+  uint64_t steals = 0;
+  uint64_t failed_steals = 0;
+  // the most tasks the worker's queue ever held
+  uint64_t queue_high_water = 0;
+
+  static WorkerStats of(const WorkerCounters& counters, uint64_t queue_high_water) {
+    return {
+      .tasks_executed = counters.tasks_executed.get(),
+      .helper_tasks = counters.helper_tasks.get(),
+      .elements_partitioned = counters.elements_partitioned.get(),
+      .busy_ns = counters.busy_ns.get(),
+      .spin_ns = counters.spin_ns.get(),
+      .parked_ns = counters.parked_ns.get(),
+      .lock_contentions = counters.lock_contentions.get(),
+      .lock_wait_ns = counters.lock_wait_ns.get(),
+      .steals = counters.steals.get(),
+      .failed_steals = counters.failed_steals.get(),
+      .queue_high_water = queue_high_water
+    };
+  }
+};
+
+// What QuicksortWorkers::stats() returns
+struct Stats {
+  vector<WorkerStats> workers;
+
+  // summed up over the workers, except the high water mark which is the highest one
+  WorkerStats total() const {
+    WorkerStats sum;
+    for (auto& w: workers) {
+      sum.tasks_executed += w.tasks_executed;
+      sum.helper_tasks += w.helper_tasks;
+      sum.elements_partitioned += w.elements_partitioned;
+      sum.busy_ns += w.busy_ns;
+      sum.spin_ns += w.spin_ns;
+      sum.parked_ns += w.parked_ns;
+      sum.lock_contentions += w.lock_contentions;
+      sum.lock_wait_ns += w.lock_wait_ns;
+      sum.steals += w.steals;
+      sum.failed_steals += w.failed_steals;
+      sum.queue_high_water = max(sum.queue_high_water, w.queue_high_water);
+    }
+    return sum;
+  }
+};
+
+// The counters of the worker running on this thread, nullptr on any other thread.
+// Lets the queues charge lock waits to whoever waited without passing the counters around.
+thread_local WorkerCounters* current_worker = nullptr;
+
+
+// One span on the timeline, i.e. a task a worker ran or a batch from submit to completion
+struct TraceEvent {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t batch_id;
+};
+
+// The events of one worker (or of the batches). Only its worker appends,
+// the mutex is there for the export and is never contended while sorting.
+struct TraceBuffer {
+  mutex mtx;
+  vector<TraceEvent> events;
+
+  void add(const TraceEvent& event) {
+    lock_guard lk(mtx);
+    events.push_back(event);
+  }
+};
+
+// Writes the timelines in the Chrome trace event format, open with chrome://tracing or ui.perfetto.dev.
+// Every worker is a thread of process 0, the batches are the threads of process 1 (one line per batch).
+void write_chrome_trace(const string& path, vector<unique_ptr<TraceBuffer>>& workers, TraceBuffer& batches,
+                        const uint64_t origin_ns) {
+  ofstream out(path);
+  out << "{\"traceEvents\": [\n";
+  out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"workers\"}},\n";
+  out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"batches\"}}";
+  auto write_event = [&](const TraceEvent& e, int pid, uint64_t tid) {
+    // a batch submitted (or a task started) before start_tracing() is cut off at the start of the trace
+    const uint64_t start_ns = max(e.start_ns, origin_ns);
+    const uint64_t end_ns = max(e.end_ns, start_ns);
+    out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << tid
+        << ", \"ts\": " << (start_ns - origin_ns) / 1000.0 << ", \"dur\": " << (end_ns - start_ns) / 1000.0
+        << ", \"args\": {\"batch\": " << e.batch_id << "}}";
+  };
+  for (size_t w=0; w < workers.size(); w++) {
+    out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << w
+        << ", \"args\": {\"name\": \"worker " << w << "\"}}";
+    lock_guard lk(workers[w]->mtx);
+    for (auto& e: workers[w]->events) {
+      write_event(e, 0, w);
+    }
+  }
+  lock_guard lk(batches.mtx);
+  for (auto& e: batches.events) {
+    write_event(e, 1, e.batch_id);
+  }
+  out << "\n]}\n";
+}
+
+}
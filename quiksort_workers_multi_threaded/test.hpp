@@ -4,48 +4,34 @@
 #include <vector>
 #include <functional>
 #include <random>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include "sequential.hpp"
+#include "concurrent.hpp"
+#include "radix.hpp"
+#include "merge.hpp"
+#include "stats.hpp"
+#include "simd_partition.hpp"
+#include "sorting_network.hpp"
+#include "external.hpp"
+#include "distributions.hpp"
+#include "key_value.hpp"
+#include "random_generator.hpp"
+#include "allocation_counter.hpp"
 
 namespace  test {
 
 using namespace std;
 
-class RandomGenerator {
-public:
-  RandomGenerator() {
-    auto random_seed = rand_dev();
-    rand_eng = default_random_engine(random_seed);
-  }
-  int generate_random_number(int min_val, int max_val) {
-    uniform_int_distribution<int> rand_distrb(min_val, max_val);
-    return rand_distrb(rand_eng);
-  }
-  vector<int> generate_random_vector(int size, int min_val, int max_val) {
-    vector<int> nums;
-    while (size--) {
-      nums.push_back(generate_random_number(min_val, max_val));
-    }
-    return nums;
-  }
-private:
-  // Note:
-  // Random device is internally a: /dev/urandom
-  // Unlike /dev/random which waits for sufficient entropy
-  // /dev/urandom doesn't wait and return immediately.
-  // The device is locked and serially served on multiple calls.
-  // The random events such as network, mouse interrupts, etc. are used to fill in the entropy pool
-  //
-  // Example:
-  // head -c 8 /dev/urandom 
-  // read the first 8 bytes from the file i.e random device
-  random_device rand_dev;
-  // we can use this true random source as a seed into pseduo random number generator engines.
-  // The sequence of bytes generated by such engine can then be used as a random number.
-  // With such engines we have more control over the distribution.
-  // Also we won't need open() & read() system calls to read from the kernel random source
-  default_random_engine rand_eng;
-};
-
 
 bool verify(const vector<int>& nums) {
   for (int i=0; i<nums.size() -1; i++) {
@@ -70,6 +56,60 @@ void test_sequential() {
   cout << "Sequential quicksort test passed!" << endl;
 }
 
+void test_simd_partition() {
+  if (!simd::avx2_enabled()) {
+    cout << "AVX2 partition test skipped, the cpu has no AVX2" << endl;
+    return;
+  }
+  RandomGenerator rand_gen;
+  for (int i=0; i<2000; i++) {
+    const int sz = rand_gen.generate_random_number(0, i < 1000 ? 100 : 5000);
+    // a narrow range now and then for lots of numbers equal to the pivot, the full range for the extremes
+    auto nums = i % 3 == 0
+      ? rand_gen.generate_random_vector(sz, numeric_limits<int>::min(), numeric_limits<int>::max())
+      : rand_gen.generate_random_vector(sz, -5, i % 3 == 1 ? 5 : 100000);
+    const int pivot = sz > 0 && i % 4 != 0 ? nums[rand_gen.generate_random_number(0, sz - 1)]
+      : (i % 8 == 0 ? numeric_limits<int>::max() : numeric_limits<int>::min());
+    auto expected = nums;
+    std::sort(expected.begin(), expected.end());
+    auto [less_end, equal_end] = simd::partition3_avx2(nums.data(), nums.data() + sz, pivot);
+    bool ok = nums.data() <= less_end && less_end <= equal_end && equal_end <= nums.data() + sz;
+    for (int* p = nums.data(); ok && p < nums.data() + sz; p++) {
+      ok = p < less_end ? *p < pivot : (p < equal_end ? *p == pivot : *p > pivot);
+    }
+    std::sort(nums.begin(), nums.end());
+    if (!ok || nums != expected) {
+      cout << "AVX2 partition test failed for " << sz << " numbers!" << endl;
+      return;
+    }
+  }
+  cout << "AVX2 partition test passed!" << endl;
+}
+
+void test_sorting_networks() {
+  if (!simd::avx2_enabled()) {
+    cout << "Sorting network test skipped, the cpu has no AVX2" << endl;
+    return;
+  }
+  RandomGenerator rand_gen;
+  for (int n=0; n <= simd::SORTING_NETWORK_MAX_SIZE; n++) {
+    for (int i=0; i<200; i++) {
+      // the full range (INT_MAX is also the padding), and few distinct numbers
+      auto nums = i % 2 == 0
+        ? rand_gen.generate_random_vector(n, numeric_limits<int>::min(), numeric_limits<int>::max())
+        : rand_gen.generate_random_vector(n, 0, 3);
+      auto expected = nums;
+      std::sort(expected.begin(), expected.end());
+      simd::sort_small_avx2(nums.data(), n);
+      if (nums != expected) {
+        cout << "Sorting network test for " << n << " numbers failed!" << endl;
+        return;
+      }
+    }
+  }
+  cout << "Sorting network test passed!" << endl;
+}
+
 void test_concurrent() {
   concurrent::QuicksortWorkers workers;
   RandomGenerator rand_gen;
@@ -90,4 +130,945 @@ void test_concurrent() {
   cout << "Concurrent quicksort test passed!" << endl;
 }
 
-} // namespace test
\ No newline at end of file
+void test_concurrent_worker_counts() {
+  // the result of a batch must not depend on how the work got stolen around
+  RandomGenerator rand_gen;
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<100; i++) {
+    auto sz = rand_gen.generate_random_number(1, 10000);
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+  }
+  auto expected = nums_batch;
+  sequential::quicksort_sequential_batch(expected);
+  for (int n : {1, 2, 3, 8}) {
+    concurrent::QuicksortWorkers workers(n);
+    auto nums_batch_copy = nums_batch;
+    workers.sort_batch(nums_batch_copy);
+    workers.kill_workers();
+    if (nums_batch_copy != expected) {
+      cout << "Concurrent quicksort test with " << n << " workers failed!" << endl;
+      return;
+    }
+  }
+  cout << "Concurrent quicksort test with different number of workers passed!" << endl;
+}
+
+void test_concurrent_grain_sizes() {
+  RandomGenerator rand_gen;
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<100; i++) {
+    auto sz = rand_gen.generate_random_number(1, 10000);
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+  }
+  auto expected = nums_batch;
+  sequential::quicksort_sequential_batch(expected);
+  vector<concurrent::Grain> grains = {
+    concurrent::Grain::none(),
+    concurrent::Grain{},
+    { .sequential_cutoff = 2, .publish_cutoff = 2 },
+    { .sequential_cutoff = 16, .publish_cutoff = 1000 },
+    { .sequential_cutoff = 100000, .publish_cutoff = 100000 }
+  };
+  for (auto& grain: grains) {
+    concurrent::QuicksortWorkers workers(3, concurrent::IdlePolicy::balanced(), grain);
+    auto nums_batch_copy = nums_batch;
+    workers.sort_batch(nums_batch_copy);
+    workers.kill_workers();
+    if (nums_batch_copy != expected) {
+      cout << "Concurrent quicksort test with sequential_cutoff " << grain.sequential_cutoff
+           << " and publish_cutoff " << grain.publish_cutoff << " failed!" << endl;
+      return;
+    }
+  }
+  cout << "Concurrent quicksort test with different grain sizes passed!" << endl;
+}
+
+void test_concurrent_single_vector() {
+  // small parallel_partition_cutoff so that the parallel partitioning kicks in on test sized vectors
+  RandomGenerator rand_gen;
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 1000 };
+  for (int n : {1, 2, 4, 7}) {
+    concurrent::QuicksortWorkers workers(n, concurrent::IdlePolicy::balanced(), grain);
+    for (int i=0; i<20; i++) {
+      auto sz = rand_gen.generate_random_number(1, 200000);
+      // few distinct numbers every now and then, lots of numbers equal to the pivot
+      auto max_val = i % 2 == 0 ? 1000000 : rand_gen.generate_random_number(1, 5);
+      auto nums = rand_gen.generate_random_vector(sz, 1, max_val);
+      auto expected = nums;
+      sequential::quicksort_sequential(0, expected.size() - 1, expected);
+      workers.sort(nums);
+      if (nums != expected) {
+        cout << "Concurrent quicksort of a single vector with " << n << " workers failed!" << endl;
+        workers.kill_workers();
+        return;
+      }
+    }
+    workers.kill_workers();
+  }
+  cout << "Concurrent quicksort of a single vector passed!" << endl;
+}
+
+// Several threads sorting on the same workers at once, with grains so small that nearly every vector
+// gets partitioned by all the workers together. Every worker ends up in parallel_for() with its helpers
+// buried under somebody else's tasks now and then, which used to hang.
+void test_concurrent_callers_stress() {
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 2000 };
+  concurrent::QuicksortWorkers workers(2, concurrent::IdlePolicy::balanced(), grain);
+  atomic<bool> failed = false;
+  vector<thread> callers;
+  for (int c=0; c<4; c++) {
+    callers.push_back(thread([&workers, &failed, c](){
+      RandomGenerator rand_gen;
+      for (int round=0; round<10 && !failed; round++) {
+        vector<vector<int>> nums_batch;
+        for (int i=0; i<8; i++) {
+          auto sz = rand_gen.generate_random_number(1, 20000);
+          nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+        }
+        if (c % 2 == 0) {
+          workers.sort_batch(nums_batch);
+        } else {
+          for (auto& nums: nums_batch) {
+            workers.sort(nums);
+          }
+        }
+        for (auto& nums: nums_batch) {
+          if (!verify(nums)) {
+            failed = true;
+          }
+        }
+      }
+    }));
+  }
+  for (auto& t: callers) {
+    t.join();
+  }
+  workers.kill_workers();
+  if (failed) {
+    cout << "Concurrent quicksort stress test with several callers failed!" << endl;
+    return;
+  }
+  cout << "Concurrent quicksort stress test with several callers passed!" << endl;
+}
+
+void test_concurrent_placement() {
+  if (concurrent::default_number_of_workers() < 1) {
+    cout << "Default number of workers test failed!" << endl;
+    return;
+  }
+  RandomGenerator rand_gen;
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<100; i++) {
+    auto sz = rand_gen.generate_random_number(1, 10000);
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+  }
+  auto expected = nums_batch;
+  sequential::quicksort_sequential_batch(expected);
+  const int first_cpu = topology::allowed_cpus().front();
+  vector<concurrent::Config> configs = {
+    { .num_workers = 3, .cpus = {first_cpu} },
+    { .num_workers = 4, .numa_aware = true },
+    { .num_workers = 4, .numa_aware = true, .topology = topology::Topology::simulated(2) },
+    { .num_workers = 5, .cpus = {first_cpu}, .numa_aware = true, .topology = topology::Topology::simulated(3) },
+  };
+  for (auto& config: configs) {
+    concurrent::QuicksortWorkers workers(config);
+    auto nums_batch_copy = nums_batch;
+    workers.sort_batch(nums_batch_copy);
+    const bool right_count = workers.number_of_workers() == config.num_workers;
+    // without explicit cpus the workers are dealt out over the nodes
+    bool right_nodes = true;
+    if (config.cpus.empty() && config.topology.has_value()) {
+      for (int i=0; i < workers.number_of_workers(); i++) {
+        right_nodes = right_nodes && workers.node_of_worker(i) == i % config.topology->number_of_nodes();
+      }
+    }
+    workers.kill_workers();
+    if (nums_batch_copy != expected || !right_count || !right_nodes) {
+      cout << "Concurrent quicksort test with pinned workers failed!" << endl;
+      return;
+    }
+  }
+
+  // NUMA placed vectors from several callers at once, on grains so small that the workers keep partitioning together
+  concurrent::QuicksortWorkers numa_workers(concurrent::Config{
+    .num_workers = 2, .numa_aware = true, .topology = topology::Topology::simulated(2),
+    .grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 2000 }
+  });
+  vector<vector<vector<int>>> batches(4, nums_batch);
+  vector<thread> callers;
+  for (auto& caller_batch: batches) {
+    callers.push_back(thread([&numa_workers, &caller_batch](){
+      numa_workers.sort_batch(caller_batch);
+    }));
+  }
+  for (auto& t: callers) {
+    t.join();
+  }
+  numa_workers.kill_workers();
+  for (auto& caller_batch: batches) {
+    if (caller_batch != expected) {
+      cout << "Concurrent quicksort test with NUMA placed vectors from several callers failed!" << endl;
+      return;
+    }
+  }
+  cout << "Concurrent quicksort test with pinned and NUMA placed workers passed!" << endl;
+}
+
+void test_radix() {
+  RandomGenerator rand_gen;
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<200; i++) {
+    auto sz = rand_gen.generate_random_number(1, 10000);
+    // negative numbers and the extremes too, the sign bit needs special care
+    auto nums = i % 2 == 0
+      ? rand_gen.generate_random_vector(sz, 1, 1000)
+      : rand_gen.generate_random_vector(sz, numeric_limits<int>::min(), numeric_limits<int>::max());
+    nums_batch.push_back(nums);
+  }
+  auto expected = nums_batch;
+  sequential::quicksort_sequential_batch(expected);
+
+  auto sequential_batch = nums_batch;
+  radix::radix_sort_sequential_batch(sequential_batch);
+  if (sequential_batch != expected) {
+    cout << "Sequential radix sort test failed!" << endl;
+    return;
+  }
+
+  // small parallel_partition_cutoff so that the big vectors get radix sorted by all the workers together
+  const concurrent::Grain grain = { .parallel_partition_cutoff = 1000 };
+  for (int n : {1, 3, 8}) {
+    concurrent::QuicksortWorkers workers(n, concurrent::IdlePolicy::balanced(), grain);
+    auto nums_batch_copy = nums_batch;
+    workers.sort_batch(nums_batch_copy, concurrent::Engine::radix);
+    auto big_nums = rand_gen.generate_random_vector(100000, -1000000, 1000000);
+    auto big_expected = big_nums;
+    sequential::quicksort_sequential(0, big_expected.size() - 1, big_expected);
+    workers.sort(big_nums, concurrent::Engine::radix);
+    workers.kill_workers();
+    if (nums_batch_copy != expected || big_nums != big_expected) {
+      cout << "Concurrent radix sort test with " << n << " workers failed!" << endl;
+      return;
+    }
+  }
+  cout << "Radix sort test passed!" << endl;
+}
+
+void test_merge() {
+  RandomGenerator rand_gen;
+  for (int n : {1, 2, 4}) {
+    concurrent::QuicksortWorkers workers(n);
+    for (int i=0; i<10; i++) {
+      // empty runs, single runs and lots of duplicates across the runs
+      vector<vector<int>> runs(rand_gen.generate_random_number(0, 40));
+      vector<int> expected;
+      for (auto& run: runs) {
+        auto sz = rand_gen.generate_random_number(0, 20000);
+        run = rand_gen.generate_random_vector(sz, 1, i % 2 == 0 ? 1000000 : 10);
+        std::sort(run.begin(), run.end());
+        expected.insert(expected.end(), run.begin(), run.end());
+      }
+      std::sort(expected.begin(), expected.end());
+
+      vector<int> merged;
+      workers.merge_batch(runs, merged);
+      vector<int> merged_sequential;
+      merge::merge_sequential(runs, merged_sequential);
+      vector<int> streamed;
+      size_t chunks = 0;
+      const size_t chunk_size = rand_gen.generate_random_number(1, 50000);
+      workers.merge_batch_chunked(runs, chunk_size, [&](const int* nums, size_t count) {
+        chunks += count <= chunk_size;
+        streamed.insert(streamed.end(), nums, nums + count);
+      });
+      if (merged != expected || merged_sequential != expected || streamed != expected
+          || chunks != (expected.size() + chunk_size - 1) / chunk_size) {
+        cout << "Merge test with " << n << " workers failed!" << endl;
+        workers.kill_workers();
+        return;
+      }
+    }
+    workers.kill_workers();
+  }
+
+  // the merge uses the comparator and projection of the workers
+  vector<vector<int>> descending_runs = {{9, 5, 5, 1}, {}, {8, 5, 2}, {7}};
+  concurrent::QuicksortWorkers<int, greater<>> descending_workers(2);
+  vector<int> merged;
+  descending_workers.merge_batch(descending_runs, merged);
+  descending_workers.kill_workers();
+  if (merged != vector<int>{9, 8, 7, 5, 5, 5, 2, 1}) {
+    cout << "Merge test with a custom comparator failed!" << endl;
+    return;
+  }
+  cout << "Merge test passed!" << endl;
+}
+
+void write_int_file(const string& path, const vector<int>& nums) {
+  ofstream file(path, ios::binary | ios::trunc);
+  file.write(reinterpret_cast<const char*>(nums.data()), nums.size() * sizeof(int));
+}
+
+vector<int> read_int_file(const string& path) {
+  ifstream file(path, ios::binary);
+  vector<int> nums(filesystem::file_size(path) / sizeof(int));
+  file.read(reinterpret_cast<char*>(nums.data()), nums.size() * sizeof(int));
+  return nums;
+}
+
+void test_external_sort() {
+  RandomGenerator rand_gen;
+  concurrent::QuicksortWorkers workers(3);
+  const string input_path = (filesystem::temp_directory_path() / "external_sort_test_input.bin").string();
+  const string output_path = (filesystem::temp_directory_path() / "external_sort_test_output.bin").string();
+  // tiny runs and buffers so that there are lots of runs and lots of refills
+  vector<external::ExternalSortConfig> configs = {
+    { .run_size = 200000, .read_buffer_size = 10000, .write_buffer_size = 7000 },
+    { .run_size = 1, .read_buffer_size = 1, .write_buffer_size = 1 },
+    // runs longer than the read buffers, every reader refills one number at a time
+    { .run_size = 4, .read_buffer_size = 1, .write_buffer_size = 3 },
+    {}
+  };
+  for (size_t c=0; c < configs.size(); c++) {
+    for (int sz : {0, 1, 1000, 1000000}) {
+      if (configs[c].read_buffer_size == 1 && sz > 1000) {
+        continue;
+      }
+      auto nums = c % 2 == 0
+        ? rand_gen.generate_random_vector(sz, numeric_limits<int>::min(), numeric_limits<int>::max())
+        : rand_gen.generate_random_vector(sz, 0, 10);
+      write_int_file(input_path, nums);
+      external::sort_file(workers, input_path, output_path, configs[c]);
+      std::sort(nums.begin(), nums.end());
+      if (read_int_file(output_path) != nums) {
+        cout << "External sort test with " << sz << " numbers failed!" << endl;
+        workers.kill_workers();
+        return;
+      }
+    }
+  }
+  // the runs are cleaned up
+  for (auto& entry: filesystem::directory_iterator(filesystem::temp_directory_path())) {
+    if (entry.path().filename().string().starts_with("external_sort_test_output.bin.run")) {
+      cout << "External sort test failed, left " << entry.path() << " behind!" << endl;
+      workers.kill_workers();
+      return;
+    }
+  }
+  bool threw = false;
+  try {
+    external::sort_file(workers, input_path + ".missing", output_path);
+  } catch (const runtime_error&) {
+    threw = true;
+  }
+  workers.kill_workers();
+  filesystem::remove(input_path);
+  filesystem::remove(output_path);
+  if (!threw) {
+    cout << "External sort test failed, a missing input file wasn't reported!" << endl;
+    return;
+  }
+  cout << "External sort test passed!" << endl;
+}
+
+void test_concurrent_overlapping_batches() {
+  concurrent::QuicksortWorkers workers(3);
+  auto make_batches = [](int num_batches) {
+    RandomGenerator rand_gen;
+    vector<vector<vector<int>>> batches;
+    for (int b=0; b<num_batches; b++) {
+      batches.push_back({});
+      for (int i=0; i<50; i++) {
+        auto sz = rand_gen.generate_random_number(1, 5000);
+        batches.back().push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+      }
+    }
+    return batches;
+  };
+  auto all_sorted = [](const vector<vector<vector<int>>>& batches) {
+    for (auto& nums_batch: batches) {
+      for (auto& nums: nums_batch) {
+        if (!verify(nums)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  // one caller with several batches in flight
+  auto batches = make_batches(5);
+  vector<future<void>> futures;
+  for (auto& nums_batch: batches) {
+    futures.push_back(workers.submit_batch(nums_batch));
+  }
+  for (auto& f: futures) {
+    f.get();
+  }
+  if (!all_sorted(batches)) {
+    cout << "Concurrent quicksort test with overlapping batches failed!" << endl;
+    workers.kill_workers();
+    return;
+  }
+
+  // several callers sharing the same workers
+  vector<vector<vector<vector<int>>>> batches_per_caller;
+  for (int c=0; c<4; c++) {
+    batches_per_caller.push_back(make_batches(3));
+  }
+  vector<thread> callers;
+  for (auto& caller_batches: batches_per_caller) {
+    callers.push_back(thread([&workers, &caller_batches](){
+      for (auto& nums_batch: caller_batches) {
+        workers.sort_batch(nums_batch, nums_batch.size() % 2 == 0 ? concurrent::Engine::quicksort : concurrent::Engine::radix);
+      }
+    }));
+  }
+  for (auto& t: callers) {
+    t.join();
+  }
+  workers.kill_workers();
+  for (auto& caller_batches: batches_per_caller) {
+    if (!all_sorted(caller_batches)) {
+      cout << "Concurrent quicksort test with several callers failed!" << endl;
+      return;
+    }
+  }
+
+  // several callers with several batches in flight each, on grains so small that the workers keep partitioning
+  // together (parallel_for()) while new vectors land in their queues
+  const concurrent::Grain tiny_grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 2000 };
+  concurrent::QuicksortWorkers tiny_grain_workers(2, concurrent::IdlePolicy::balanced(), tiny_grain);
+  batches_per_caller.clear();
+  for (int c=0; c<4; c++) {
+    batches_per_caller.push_back(make_batches(3));
+  }
+  callers.clear();
+  for (auto& caller_batches: batches_per_caller) {
+    callers.push_back(thread([&tiny_grain_workers, &caller_batches](){
+      vector<future<void>> caller_futures;
+      for (auto& nums_batch: caller_batches) {
+        caller_futures.push_back(tiny_grain_workers.submit_batch(nums_batch));
+      }
+      for (auto& f: caller_futures) {
+        f.get();
+      }
+    }));
+  }
+  for (auto& t: callers) {
+    t.join();
+  }
+  tiny_grain_workers.kill_workers();
+  for (auto& caller_batches: batches_per_caller) {
+    if (!all_sorted(caller_batches)) {
+      cout << "Concurrent quicksort test with several callers and tiny grains failed!" << endl;
+      return;
+    }
+  }
+  cout << "Concurrent quicksort test with overlapping batches passed!" << endl;
+}
+
+struct Record {
+  int64_t key;
+  float weight;
+  string name;
+
+  bool operator==(const Record&) const = default;
+};
+
+// sorted according to comp and proj, and nothing got lost or duplicated on the way
+template<typename T, typename Compare, typename Projection>
+bool verify_generic(const vector<T>& sorted, const vector<T>& original, Compare comp, Projection proj) {
+  return ranges::is_sorted(sorted, comp, proj) && ranges::is_permutation(sorted, original);
+}
+
+template<typename T, typename Compare, typename Projection, typename Generator>
+bool test_generic_type(Compare comp, Projection proj, Generator generate) {
+  RandomGenerator rand_gen;
+  vector<vector<T>> nums_batch;
+  for (int i=0; i<50; i++) {
+    auto sz = rand_gen.generate_random_number(1, 2000);
+    vector<T> nums;
+    while (sz--) {
+      nums.push_back(generate(rand_gen));
+    }
+    nums_batch.push_back(nums);
+  }
+
+  auto sequential_batch = nums_batch;
+  sequential::quicksort_sequential_batch(sequential_batch, comp, proj);
+
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 1000 };
+  concurrent::QuicksortWorkers<T, Compare, Projection> workers(3, concurrent::IdlePolicy::balanced(), grain, comp, proj);
+  auto concurrent_batch = nums_batch;
+  workers.sort_batch(concurrent_batch);
+  workers.kill_workers();
+
+  for (size_t i=0; i<nums_batch.size(); i++) {
+    if (!verify_generic(sequential_batch[i], nums_batch[i], comp, proj) ||
+        !verify_generic(concurrent_batch[i], nums_batch[i], comp, proj)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void test_generic() {
+  bool passed =
+    test_generic_type<int64_t>(greater<>(), identity(), [](RandomGenerator& rand_gen) {
+      return static_cast<int64_t>(rand_gen.generate_random_number(-1000, 1000)) << 40;
+    }) &&
+    test_generic_type<float>(less<>(), identity(), [](RandomGenerator& rand_gen) {
+      return rand_gen.generate_random_number(-100000, 100000) / 7.0f;
+    }) &&
+    // not trivially copyable
+    test_generic_type<string>(less<>(), identity(), [](RandomGenerator& rand_gen) {
+      return to_string(rand_gen.generate_random_number(1, 1000));
+    }) &&
+    // sorted by a member, the rest is carried along
+    test_generic_type<Record>(less<>(), &Record::key, [](RandomGenerator& rand_gen) {
+      const int key = rand_gen.generate_random_number(1, 100);
+      return Record{ .key = key, .weight = key / 3.0f, .name = to_string(rand_gen.generate_random_number(1, 1000)) };
+    }) &&
+    test_generic_type<pair<int, int>>(less<>(), [](const pair<int, int>& p) { return p.first + p.second; }, [](RandomGenerator& rand_gen) {
+      return pair<int, int>{rand_gen.generate_random_number(1, 100), rand_gen.generate_random_number(1, 100)};
+    });
+  if (!passed) {
+    cout << "Generic quicksort test failed!" << endl;
+    return;
+  }
+
+  concurrent::QuicksortWorkers<float> workers(1);
+  vector<float> floats = {2.0f, 1.0f};
+  bool threw = false;
+  try {
+    workers.sort(floats, concurrent::Engine::radix);
+  } catch (const invalid_argument&) {
+    threw = true;
+  }
+  workers.kill_workers();
+  if (!threw) {
+    cout << "Generic quicksort test failed, radix engine accepted floats!" << endl;
+    return;
+  }
+  cout << "Generic quicksort test passed!" << endl;
+}
+
+void test_concurrent_selection() {
+  RandomGenerator rand_gen;
+  // small cutoffs, so that ranges get published, stolen and partitioned by all the workers
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 5000 };
+  concurrent::QuicksortWorkers workers(3, concurrent::IdlePolicy::balanced(), grain);
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<30; i++) {
+    auto sz = rand_gen.generate_random_number(1, 20000);
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, i % 2 == 0 ? 100 : 1000000));
+  }
+  auto sorted_batch = nums_batch;
+  for (auto& nums: sorted_batch) {
+    std::sort(nums.begin(), nums.end());
+  }
+  bool passed = true;
+
+  for (int k: {0, 1, 10, 1000, 15000, 30000}) {
+    auto copy = nums_batch;
+    workers.partial_sort_batch(copy, k);
+    for (size_t i=0; i < copy.size(); i++) {
+      const size_t first = min<size_t>(k, copy[i].size());
+      auto rest = copy[i];
+      std::sort(rest.begin(), rest.end());
+      if (!equal(copy[i].begin(), copy[i].begin() + first, sorted_batch[i].begin()) || rest != sorted_batch[i]) {
+        passed = false;
+      }
+    }
+  }
+
+  for (int nth: {0, 1, 500, 9999, 19999, 25000}) {
+    auto copy = nums_batch;
+    workers.nth_element_batch(copy, nth);
+    for (size_t i=0; i < copy.size(); i++) {
+      if (nth >= static_cast<int>(copy[i].size())) {
+        passed = passed && copy[i] == nums_batch[i];
+        continue;
+      }
+      const int value = copy[i][nth];
+      if (value != sorted_batch[i][nth]
+          || any_of(copy[i].begin(), copy[i].begin() + nth, [&](int num) { return num > value; })
+          || any_of(copy[i].begin() + nth + 1, copy[i].end(), [&](int num) { return num < value; })) {
+        passed = false;
+      }
+    }
+  }
+
+  vector<int> all;
+  for (auto& nums: nums_batch) {
+    all.insert(all.end(), nums.begin(), nums.end());
+  }
+  std::sort(all.begin(), all.end());
+  for (int k: {0, 7, 5000, 1 << 30}) {
+    auto copy = nums_batch;
+    const vector<int> smallest = workers.top_k(copy, k);
+    if (smallest != vector<int>(all.begin(), all.begin() + min<size_t>(k, all.size()))) {
+      passed = false;
+    }
+  }
+  workers.kill_workers();
+
+  if (!passed) {
+    cout << "Concurrent partial sort / nth element / top k test failed!" << endl;
+    return;
+  }
+  cout << "Concurrent partial sort / nth element / top k test passed!" << endl;
+}
+
+void test_key_value() {
+  RandomGenerator rand_gen;
+  bool passed = true;
+  // every payload remembers its key, so after sorting payloads[i] has to belong to keys[i]
+  auto check = [&](const vector<int>& keys, const vector<string>& payloads, const vector<int>& original_keys) {
+    auto expected = original_keys;
+    std::sort(expected.begin(), expected.end());
+    if (keys != expected) {
+      return false;
+    }
+    for (size_t i=0; i < keys.size(); i++) {
+      if (payloads[i] != "payload of " + to_string(keys[i])) {
+        return false;
+      }
+    }
+    return true;
+  };
+  vector<vector<int>> keys_batch;
+  for (int size: {0, 1, 2, 15, 100, 5000}) {
+    keys_batch.push_back(rand_gen.generate_random_vector(size, 1, 1000));
+  }
+  for (const string distribution: {"sorted", "reversed", "organ_pipe", "few_unique"}) {
+    keys_batch.push_back(distributions::generate(distribution, 10000));
+  }
+  vector<vector<string>> payloads_batch;
+  for (auto& keys: keys_batch) {
+    payloads_batch.push_back({});
+    for (int key: keys) {
+      payloads_batch.back().push_back("payload of " + to_string(key));
+    }
+  }
+
+  for (size_t i=0; i < keys_batch.size(); i++) {
+    auto keys = keys_batch[i];
+    auto payloads = payloads_batch[i];
+    key_value::sort_by_key(keys, payloads);
+    passed = passed && check(keys, payloads, keys_batch[i]);
+
+    const vector<uint32_t> indices = key_value::argsort(keys_batch[i]);
+    vector<uint32_t> all_indices(indices);
+    std::sort(all_indices.begin(), all_indices.end());
+    for (size_t j=0; j < all_indices.size(); j++) {
+      passed = passed && all_indices[j] == j;
+    }
+    for (size_t j=1; j < indices.size(); j++) {
+      passed = passed && keys_batch[i][indices[j-1]] <= keys_batch[i][indices[j]];
+    }
+  }
+
+  // descending, through the workers
+  concurrent::QuicksortWorkers<int, greater<>> workers(3);
+  auto keys_copy = keys_batch;
+  auto payloads_copy = payloads_batch;
+  workers.sort_by_key_batch(keys_copy, payloads_copy);
+  const auto indices_batch = workers.argsort_batch(keys_batch);
+  workers.kill_workers();
+  for (size_t i=0; i < keys_batch.size(); i++) {
+    passed = passed && is_sorted(keys_copy[i].begin(), keys_copy[i].end(), greater<>());
+    for (size_t j=0; j < keys_copy[i].size(); j++) {
+      passed = passed && payloads_copy[i][j] == "payload of " + to_string(keys_copy[i][j]);
+    }
+    for (size_t j=1; j < indices_batch[i].size(); j++) {
+      passed = passed && keys_batch[i][indices_batch[i][j-1]] >= keys_batch[i][indices_batch[i][j]];
+    }
+    passed = passed && indices_batch[i].size() == keys_batch[i].size();
+  }
+
+  if (!passed) {
+    cout << "Key value sort / argsort test failed!" << endl;
+    return;
+  }
+  cout << "Key value sort / argsort test passed!" << endl;
+}
+
+void test_concurrent_cancellation() {
+  RandomGenerator rand_gen;
+  const concurrent::Grain grain = { .sequential_cutoff = 64, .publish_cutoff = 1024, .parallel_partition_cutoff = 50000 };
+  concurrent::QuicksortWorkers workers(2, concurrent::IdlePolicy::balanced(), grain);
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<200; i++) {
+    nums_batch.push_back(rand_gen.generate_random_vector(rand_gen.generate_random_number(1, 100000), 1, 1000000));
+  }
+  bool passed = true;
+  // a completed vector has to be sorted, a dropped one still has to hold the same numbers
+  auto check = [&](vector<vector<int>>& copy, const concurrent::BatchOutcome& outcome) {
+    if (outcome.completed.size() != nums_batch.size()) {
+      return false;
+    }
+    for (size_t i=0; i < copy.size(); i++) {
+      if (outcome.completed[i] && !is_sorted(copy[i].begin(), copy[i].end())) {
+        return false;
+      }
+      auto original = nums_batch[i];
+      std::sort(original.begin(), original.end());
+      std::sort(copy[i].begin(), copy[i].end());
+      if (copy[i] != original) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // nothing gets in the way
+  auto copy = nums_batch;
+  auto outcome = workers.sort_batch(copy, concurrent::CancellationToken());
+  passed = passed && outcome.all_completed() && check(copy, outcome);
+
+  // past its deadline before it even started, nothing is touched
+  copy = nums_batch;
+  outcome = workers.sort_batch(copy, concurrent::CancellationToken(), chrono::steady_clock::now() - chrono::seconds(1));
+  passed = passed && none_of(outcome.completed.begin(), outcome.completed.end(), [](bool c) { return c; })
+    && copy == nums_batch;
+
+  // cancelled while being sorted
+  copy = nums_batch;
+  concurrent::CancellationToken token;
+  auto outcome_future = workers.submit_batch(copy, token);
+  this_thread::sleep_for(chrono::milliseconds(5));
+  token.cancel();
+  outcome = outcome_future.get();
+  passed = passed && !outcome.all_completed() && check(copy, outcome);
+
+  // the workers are free again
+  copy = nums_batch;
+  workers.sort_batch(copy);
+  workers.kill_workers();
+  for (auto& nums: copy) {
+    passed = passed && is_sorted(nums.begin(), nums.end());
+  }
+
+  if (!passed) {
+    cout << "Concurrent quicksort cancellation test failed!" << endl;
+    return;
+  }
+  cout << "Concurrent quicksort cancellation test passed!" << endl;
+}
+
+void test_concurrent_clients() {
+  RandomGenerator rand_gen;
+  const concurrent::Grain grain = { .sequential_cutoff = 64, .publish_cutoff = 1024, .parallel_partition_cutoff = 50000 };
+  concurrent::QuicksortWorkers workers(2, concurrent::IdlePolicy::balanced(), grain);
+  bool passed = true;
+
+  // clients of every class submitting at the same time, plus the default client
+  const int high = workers.add_client(concurrent::Priority::high);
+  const int normal = workers.add_client(concurrent::Priority::normal, 3);
+  const int low = workers.add_client(concurrent::Priority::low);
+  vector<vector<vector<int>>> batches(4);
+  for (auto& batch: batches) {
+    for (int i=0; i<50; i++) {
+      batch.push_back(rand_gen.generate_random_vector(rand_gen.generate_random_number(0, 20000), 1, 1000000));
+    }
+  }
+  vector<thread> submitters;
+  const int clients[] = {high, normal, low};
+  for (int c=0; c < 3; c++) {
+    submitters.emplace_back([&, c]() { workers.sort_batch_as(clients[c], batches[c]); });
+  }
+  submitters.emplace_back([&]() { workers.sort_batch(batches[3]); });
+  for (auto& submitter: submitters) {
+    submitter.join();
+  }
+  for (auto& batch: batches) {
+    for (auto& nums: batch) {
+      passed = passed && is_sorted(nums.begin(), nums.end());
+    }
+  }
+
+  // a small high priority batch doesn't wait for a big low priority one submitted before it
+  vector<vector<int>> big_batch;
+  for (int i=0; i<200; i++) {
+    big_batch.push_back(rand_gen.generate_random_vector(100000, 1, 1000000));
+  }
+  vector<vector<int>> small_batch = {rand_gen.generate_random_vector(1000, 1, 1000000)};
+  auto big_future = workers.submit_batch_as(low, big_batch);
+  workers.sort_batch_as(high, small_batch);
+  passed = passed && is_sorted(small_batch[0].begin(), small_batch[0].end())
+    && big_future.wait_for(chrono::seconds(0)) != future_status::ready;
+  big_future.get();
+  workers.kill_workers();
+  for (auto& nums: big_batch) {
+    passed = passed && is_sorted(nums.begin(), nums.end());
+  }
+
+  if (!passed) {
+    cout << "Concurrent quicksort clients test failed!" << endl;
+    return;
+  }
+  cout << "Concurrent quicksort clients test passed!" << endl;
+}
+
+// counts its compares, shared by all the copies the sorts make
+struct CountingLess {
+  atomic<long long>* compares;
+
+  bool operator()(int a, int b) const {
+    compares->fetch_add(1, memory_order_relaxed);
+    return a < b;
+  }
+};
+
+// Inputs which drive a quicksort with a fixed pivot choice to O(n^2).
+// With the guards of sequential.hpp every one of them has to sort in O(n log n) compares, in both engines.
+void test_quadratic_killers() {
+  const int n = 1 << 16;
+  // heapsort after a budget of bad partitions is ~3 n log2 n, a quadratic sort needs ~n^2 / 4 = 16384 n log2(n) / 16
+  const long long max_compares = 10LL * n * 16;
+  vector<pair<string, vector<int>>> inputs;
+  for (const string distribution: {"sorted", "reversed", "organ_pipe", "sawtooth", "few_unique", "antiqsort"}) {
+    inputs.push_back({distribution, distributions::generate(distribution, n)});
+  }
+  inputs.push_back({"all_equal", vector<int>(n, 7)});
+  // the adversary again, against the concurrent engine this time
+  inputs.push_back({"antiqsort_concurrent", distributions::antiqsort(n, [](vector<int>& indices, auto less_than) {
+    concurrent::QuicksortWorkers<int, decltype(less_than)> workers(1, concurrent::IdlePolicy::balanced(),
+      concurrent::Grain{ .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 5000 }, less_than);
+    workers.sort(indices);
+    workers.kill_workers();
+  })});
+
+  atomic<long long> compares = 0;
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 5000 };
+  concurrent::QuicksortWorkers<int, CountingLess> counting_workers(3, concurrent::IdlePolicy::balanced(), grain,
+                                                                   CountingLess{&compares});
+  concurrent::QuicksortWorkers workers(3, concurrent::IdlePolicy::balanced(), grain);
+  bool passed = true;
+  for (auto& [name, input]: inputs) {
+    vector<int> expected = input;
+    std::sort(expected.begin(), expected.end());
+
+    vector<int> nums = input;
+    compares = 0;
+    sequential::quicksort_sequential(0, n - 1, nums, CountingLess{&compares});
+    const long long sequential_compares = compares;
+
+    vector<int> concurrent_nums = input;
+    compares = 0;
+    counting_workers.sort(concurrent_nums);
+    const long long concurrent_compares = compares;
+
+    // the int fast paths (AVX2 kernels, parallel partition) have their own code but the same pivots
+    vector<int> int_nums = input;
+    workers.sort(int_nums);
+    vector<int> sequential_int_nums = input;
+    sequential::quicksort_sequential(0, n - 1, sequential_int_nums);
+
+    if (nums != expected || concurrent_nums != expected || int_nums != expected || sequential_int_nums != expected) {
+      cout << "Quadratic killer test failed, " << name << " not sorted!" << endl;
+      passed = false;
+    } else if (sequential_compares > max_compares || concurrent_compares > max_compares) {
+      cout << "Quadratic killer test failed, " << name << " took " << sequential_compares << " / "
+           << concurrent_compares << " compares!" << endl;
+      passed = false;
+    }
+  }
+  counting_workers.kill_workers();
+  workers.kill_workers();
+
+  // none of the inputs above got through the pivot sampling (the adversary is caught by the presorted check),
+  // the fallback on its own, with every bad partition budget
+  RandomGenerator rand_gen;
+  for (int budget = 0; budget <= 2; budget++) {
+    vector<int> nums = rand_gen.generate_random_vector(10000, 1, 1000);
+    vector<int> expected = nums;
+    std::sort(expected.begin(), expected.end());
+    sequential::introsort(0, static_cast<int>(nums.size()) - 1, nums, budget, less<>(), identity());
+    if (nums != expected) {
+      cout << "Quadratic killer test failed, heapsort fallback not sorted!" << endl;
+      passed = false;
+    }
+  }
+  if (passed) {
+    cout << "Quadratic killer test passed!" << endl;
+  }
+}
+
+void test_concurrent_stats() {
+  RandomGenerator rand_gen;
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 5000 };
+  concurrent::QuicksortWorkers workers(3, concurrent::IdlePolicy::balanced(), grain);
+  vector<vector<int>> nums_batch;
+  size_t total_numbers = 0;
+  for (int i=0; i<50; i++) {
+    auto sz = rand_gen.generate_random_number(100, 10000);
+    total_numbers += sz;
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+  }
+  workers.start_tracing();
+  workers.sort_batch(nums_batch);
+  workers.stop_tracing();
+  const stats::Stats snapshot = workers.stats();
+  const string trace_path = (filesystem::temp_directory_path() / "quicksort_workers_trace.json").string();
+  workers.write_chrome_trace(trace_path);
+  workers.kill_workers();
+
+  if constexpr (stats::ENABLED) {
+    const stats::WorkerStats total = snapshot.total();
+    // every vector is at least one task and gets partitioned at least once as a whole
+    if (snapshot.workers.size() != 3 || total.tasks_executed < nums_batch.size()
+        || total.elements_partitioned < total_numbers || total.queue_high_water == 0 || total.busy_ns == 0) {
+      cout << "Concurrent quicksort stats test failed!" << endl;
+      return;
+    }
+  }
+  ifstream trace_file(trace_path);
+  const string trace((istreambuf_iterator<char>(trace_file)), istreambuf_iterator<char>());
+  filesystem::remove(trace_path);
+  if (trace.find("\"traceEvents\"") == string::npos
+      || (stats::ENABLED && (trace.find("\"name\": \"batch\"") == string::npos
+                             || trace.find("\"name\": \"sort\"") == string::npos))) {
+    cout << "Concurrent quicksort stats test failed, bad trace!" << endl;
+    return;
+  }
+  cout << "Concurrent quicksort stats test passed!" << endl;
+}
+
+void test_concurrent_no_allocations() {
+  const concurrent::Grain grain = { .sequential_cutoff = 16, .publish_cutoff = 64, .parallel_partition_cutoff = 2000 };
+  concurrent::QuicksortWorkers workers(3, concurrent::IdlePolicy::balanced(), grain);
+  RandomGenerator rand_gen;
+  vector<vector<int>> nums_batch;
+  for (int i=0; i<100; i++) {
+    auto sz = rand_gen.generate_random_number(1, 10000);
+    nums_batch.push_back(rand_gen.generate_random_vector(sz, 1, 1000));
+  }
+  // let the queues and the scratch space of the workers grow to their working size
+  for (int i=0; i<3; i++) {
+    auto warm_up_batch = nums_batch;
+    workers.sort_batch(warm_up_batch);
+  }
+
+  auto nums_batch_copy = nums_batch;
+  const long long allocations_before = allocations;
+  workers.sort_batch(nums_batch_copy);
+  const long long batch_allocations = allocations - allocations_before;
+  workers.kill_workers();
+
+  // the Batch and its promise (how many allocations that is depends on the standard library),
+  // nothing for the tasks
+  const long long before_bookkeeping = allocations;
+  delete new concurrent::Batch();
+  const long long bookkeeping_allocations = allocations - before_bookkeeping;
+  if (batch_allocations > bookkeeping_allocations) {
+    cout << "Concurrent quicksort allocation test failed, " << batch_allocations << " allocations for one batch!" << endl;
+    return;
+  }
+  cout << "Concurrent quicksort allocation test passed!" << endl;
+}
+
+} // namespace test
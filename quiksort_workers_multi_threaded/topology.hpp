@@ -0,0 +1,203 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+// Which cpus we may run on and how they are grouped into NUMA nodes.
+// Everything here is read from /sys and the scheduler on linux,
+// elsewhere it falls back to a single node with hardware_concurrency() cpus and no pinning.
+namespace topology {
+
+using namespace std;
+
+
+// "0-3,8,10-11" as found in /sys/devices/system/node/node0/cpulist
+vector<int> parse_cpu_list(const string& list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    const size_t dash = range.find('-');
+    const int first = stoi(range.substr(0, dash));
+    const int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// the cpus this process is allowed to run on, e.g. restricted by taskset or a cpuset cgroup
+vector<int> allowed_cpus() {
+  vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    for (int cpu = 0; cpu < max(1, static_cast<int>(thread::hardware_concurrency())); cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// How many cpus worth of time the cgroup quota (docker --cpus, k8s limits) allows, 0 if unlimited.
+// A container can see all the cpus of the host and still only get 2 of them.
+int cgroup_cpu_limit() {
+  double quota = -1;
+  double period = -1;
+  // cgroup v2: "max 100000" or "200000 100000"
+  ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+  string quota_str;
+  if (cpu_max >> quota_str >> period) {
+    if (quota_str != "max") {
+      quota = stod(quota_str);
+    }
+  } else {
+    // cgroup v1, -1 means unlimited
+    ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if (!(quota_file >> quota) || !(period_file >> period)) {
+      quota = -1;
+    }
+  }
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return max(1, static_cast<int>(ceil(quota / period)));
+}
+
+// the number of cpus we can actually keep busy
+int usable_cpus() {
+  int cpus = allowed_cpus().size();
+  const int limit = cgroup_cpu_limit();
+  if (limit > 0) {
+    cpus = min(cpus, limit);
+  }
+  return max(1, cpus);
+}
+
+
+struct Topology {
+  // the allowed cpus of every node
+  vector<vector<int>> node_cpus;
+  // the node whose memory holds the page of the given address
+  function<int(const void*)> node_of_memory;
+
+  int number_of_nodes() const {
+    return node_cpus.size();
+  }
+
+  int node_of_cpu(int cpu) const {
+    for (int node = 0; node < number_of_nodes(); node++) {
+      if (find(node_cpus[node].begin(), node_cpus[node].end(), cpu) != node_cpus[node].end()) {
+        return node;
+      }
+    }
+    return 0;
+  }
+
+  // The machine we are running on. Nodes without any allowed cpu are left out.
+  static Topology detect() {
+    const vector<int> allowed = allowed_cpus();
+    Topology topology;
+    for (int node = 0; ; node++) {
+      ifstream cpulist("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+      string list;
+      if (!getline(cpulist, list)) {
+        break;
+      }
+      vector<int> cpus;
+      for (int cpu: parse_cpu_list(list)) {
+        if (find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+          cpus.push_back(cpu);
+        }
+      }
+      topology.node_cpus.push_back(cpus);
+    }
+    const bool any_cpu = any_of(topology.node_cpus.begin(), topology.node_cpus.end(),
+                                [](const vector<int>& cpus) { return !cpus.empty(); });
+    if (!any_cpu) {
+      topology.node_cpus = {allowed};
+    }
+    topology.node_of_memory = [](const void* address) { return memory_node(address); };
+    return topology;
+  }
+
+  // Pretends the allowed cpus are split into nodes, e.g. to exercise the NUMA aware scheduling on a single socket box.
+  // There is no real memory behind the fake nodes, so addresses are dealt out over them 2MB (a huge page) at a time.
+  static Topology simulated(int num_nodes) {
+    const vector<int> allowed = allowed_cpus();
+    Topology topology;
+    topology.node_cpus.resize(num_nodes);
+    for (int node = 0; node < num_nodes; node++) {
+      // with fewer cpus than nodes some nodes share cpus
+      for (size_t i = node % allowed.size(); i < allowed.size(); i += num_nodes) {
+        topology.node_cpus[node].push_back(allowed[i]);
+      }
+    }
+    topology.node_of_memory = [num_nodes](const void* address) {
+      return static_cast<int>((reinterpret_cast<uintptr_t>(address) >> 21) % num_nodes);
+    };
+    return topology;
+  }
+
+  // Asks the kernel which node the page backing the address lives on.
+  // 0 when it can't tell, e.g. on a machine without NUMA or when the page hasn't been touched yet.
+  static int memory_node(const void* address) {
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+    // MPOL_F_NODE | MPOL_F_ADDR, spelled out to not depend on libnuma's numaif.h
+    constexpr unsigned long MPOL_F_NODE_ = 1 << 0;
+    constexpr unsigned long MPOL_F_ADDR_ = 1 << 1;
+    int node = 0;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE_ | MPOL_F_ADDR_) == 0) {
+      return node;
+    }
+#endif
+    (void) address;
+    return 0;
+  }
+};
+
+
+// Restricts the calling thread to the given cpus. Returns false if that isn't possible here.
+bool pin_current_thread(const vector<int>& cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu: cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void) cpus;
+  return false;
+#endif
+}
+
+}